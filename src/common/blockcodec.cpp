@@ -0,0 +1,158 @@
+/*
+Nexus
+
+Copyright(C) 2012 - Federico Ponchio
+ISTI - Italian National Research Council - Visual Computing Lab
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
+for more details.
+*/
+#include "blockcodec.h"
+
+#include <string.h>
+#include <vector>
+
+static const int HASH_BITS = 16;
+static const quint32 MIN_MATCH = 4;
+static const quint32 LAST_LITERALS = 5;   //the format wants the last bytes as literals
+static const quint32 MATCH_LIMIT = 12;    //and no match starting this close to the end
+
+static inline quint32 read32(const uchar *p) {
+	quint32 v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline quint32 hash(quint32 v) {
+	return (v*2654435761u) >> (32 - HASH_BITS);
+}
+
+static inline uchar *writeLength(uchar *op, quint32 length) {
+	while(length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = (uchar)length;
+	return op;
+}
+
+static inline uchar *writeLiterals(uchar *op, uchar *token, const uchar *start, quint32 length) {
+	if(length >= 15) {
+		*token = 15<<4;
+		op = writeLength(op, length - 15);
+	} else
+		*token = (uchar)(length<<4);
+	memcpy(op, start, length);
+	return op + length;
+}
+
+quint32 BlockCodec::compress(const uchar *src, quint32 size, uchar *dst) {
+	const uchar *ip = src;
+	const uchar *anchor = src;
+	const uchar *end = src + size;
+	uchar *op = dst;
+
+	if(size > MATCH_LIMIT) {
+		std::vector<quint32> table(1<<HASH_BITS, 0);
+		const uchar *match_limit = end - MATCH_LIMIT;
+		const uchar *copy_limit = end - LAST_LITERALS;
+		while(ip < match_limit) {
+			quint32 sequence = read32(ip);
+			quint32 &slot = table[hash(sequence)];
+			const uchar *ref = src + slot;
+			slot = ip - src;
+			if(ref >= ip || ip - ref > 0xffff || read32(ref) != sequence) {
+				ip += 1 + ((ip - anchor)>>6); //skip faster on incompressible data
+				continue;
+			}
+			while(ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			const uchar *m = ip + MIN_MATCH;
+			const uchar *r = ref + MIN_MATCH;
+			while(m < copy_limit && *m == *r) {
+				m++;
+				r++;
+			}
+
+			uchar *token = op++;
+			op = writeLiterals(op, token, anchor, ip - anchor);
+			quint32 offset = ip - ref;
+			*op++ = offset & 0xff;
+			*op++ = offset >> 8;
+			quint32 length = (m - ip) - MIN_MATCH;
+			if(length >= 15) {
+				*token |= 15;
+				op = writeLength(op, length - 15);
+			} else
+				*token |= length;
+
+			ip = anchor = m;
+		}
+	}
+	uchar *token = op++;
+	op = writeLiterals(op, token, anchor, end - anchor);
+	return op - dst;
+}
+
+bool BlockCodec::decompress(const uchar *src, quint32 compressed, uchar *dst, quint32 size) {
+	const uchar *ip = src;
+	const uchar *iend = src + compressed;
+	uchar *op = dst;
+	uchar *oend = dst + size;
+
+	while(ip < iend) {
+		uchar token = *ip++;
+		quint32 length = token>>4;
+		if(length == 15) {
+			uchar b;
+			do {
+				if(ip >= iend) return false;
+				b = *ip++;
+				length += b;
+			} while(b == 255);
+		}
+		if(length > (quint32)(iend - ip) || length > (quint32)(oend - op))
+			return false;
+		memcpy(op, ip, length);
+		ip += length;
+		op += length;
+		if(ip == iend) //last sequence has no match
+			break;
+
+		if(iend - ip < 2) return false;
+		quint32 offset = ip[0] | (ip[1]<<8);
+		ip += 2;
+		if(offset == 0 || offset > (quint32)(op - dst))
+			return false;
+		length = token & 15;
+		if(length == 15) {
+			uchar b;
+			do {
+				if(ip >= iend) return false;
+				b = *ip++;
+				length += b;
+			} while(b == 255);
+		}
+		length += MIN_MATCH;
+		if(length > (quint32)(oend - op))
+			return false;
+		const uchar *ref = op - offset;
+		if(offset >= length)
+			memcpy(op, ref, length);
+		else
+			for(quint32 i = 0; i < length; i++) //overlapping: repeats the last offset bytes
+				op[i] = ref[i];
+		op += length;
+	}
+	return op == oend;
+}
@@ -0,0 +1,37 @@
+/*
+Nexus
+
+Copyright(C) 2012 - Federico Ponchio
+ISTI - Italian National Research Council - Visual Computing Lab
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
+for more details.
+*/
+#ifndef NX_BLOCKCODEC_H
+#define NX_BLOCKCODEC_H
+
+#include <QtGlobal>
+
+/* byte oriented LZ77 in the LZ4 block format (token, literals, 16 bit offset, match length):
+   no entropy coding, decompression is a sequence of memcpy.
+   Used for temporary data only, nothing compressed here is meant to be kept in a file. */
+
+class BlockCodec {
+public:
+	//worst case size of the compressed data, dst passed to compress must be this large.
+	static quint32 bound(quint32 size) { return size + size/255 + 16; }
+	//returns the compressed size.
+	static quint32 compress(const uchar *src, quint32 size, uchar *dst);
+	//false if the data is corrupted or does not decompress to exactly size bytes.
+	static bool decompress(const uchar *src, quint32 compressed, uchar *dst, quint32 size);
+};
+
+#endif // NX_BLOCKCODEC_H
@@ -17,16 +17,26 @@ for more details.
 */
 #include <assert.h>
 #include "virtualarray.h"
+#include "blockcodec.h"
 #include <iostream>
+#include <string.h>
+#include <stdlib.h>
 
 #include <QDir>
 
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 
 VirtualMemory::VirtualMemory(QString prefix):
 	QTemporaryFile(QDir::tempPath() +"/" + prefix),
 	used_memory(0),
-	max_memory(1<<28) {
+	max_memory(1<<28),
+	policy(new LRUPolicy) {
 
 	setAutoRemove(true);
 	if(!open())
@@ -35,24 +45,50 @@ VirtualMemory::VirtualMemory(QString prefix):
 }
 
 VirtualMemory::~VirtualMemory() {
-	flush();
+	discard();
+	delete policy;
 }
 
 void VirtualMemory::setMaxMemory(quint64 n) {
 	max_memory = n;
+	if(in_core && used_memory > max_memory) //in core blocks cannot be evicted
+		spill();
+}
+
+void VirtualMemory::setCompressed(bool on) {
+	if(cache.size())
+		throw QString("compression must be set before adding blocks to " + fileName());
+	compressed = on;
 }
 
-uchar *VirtualMemory::getBlock(quint64 index, bool prevent_unload) {
+void VirtualMemory::setInCore(bool on) {
+	if(cache.size())
+		throw QString("in core mode must be set before adding blocks to " + fileName());
+	in_core = on;
+}
+
+void VirtualMemory::setEvictionPolicy(EvictionPolicy *p) {
+	flush();
+	delete policy;
+	policy = p;
+	policy->resize(cache.size());
+	for(quint64 i = 0; i < cache.size(); i++) //in core blocks survive the flush
+		if(cache[i])
+			policy->insert(i);
+}
+
+uchar *VirtualMemory::getBlock(quint64 index) {
 
 	assert(index < cache.size());
 	if(cache[index] == NULL) { //not mapped.
-		if(!prevent_unload)
-			makeRoom();
+		makeRoom();
 		mapBlock(index);
 		if(!cache[index])
 			throw QString("virtual memory error mapping block: " + this->errorString());
 
-		mapped.push_front(index);
+	} else {
+		counters.hits++;
+		policy->touch(index);
 	}
 	return cache[index];
 }
@@ -61,7 +97,84 @@ void VirtualMemory::dropBlock(quint64 index) {
 	unmapBlock(index);
 }
 
+uchar *VirtualMemory::pinBlock(quint64 index) {
+	uchar *memory = getBlock(index);
+	pins[index]++;
+	return memory;
+}
+
+void VirtualMemory::unpinBlock(quint64 index) {
+	assert(pins[index] > 0);
+	pins[index]--;
+}
+
+uchar *VirtualMemory::acquireBlock(quint64 index) {
+	QMutexLocker locker(&m_cache);
+	return pinBlock(index);
+}
+
+void VirtualMemory::releaseBlock(quint64 index, bool drop) {
+	QMutexLocker locker(&m_cache);
+	unpinBlock(index);
+	if(drop && !pins[index] && cache[index])
+		unmapBlock(index);
+}
+
+void VirtualMemory::prefetchBlock(quint64 index) {
+	assert(index < cache.size());
+	counters.prefetches++;
+	uchar *memory = cache[index];
+	if(!memory) {
+		makeRoom();
+		memory = mapBlock(index);
+		if(!memory)
+			return; //just a hint.
+	}
+	if(heap[index]) //already in RAM
+		return;
+#ifndef WIN32
+	//madvise wants page aligned addresses.
+	quintptr page = sysconf(_SC_PAGESIZE);
+	quintptr start = (quintptr)memory & ~(page -1);
+	quintptr end = (quintptr)memory + blockSize(index);
+	posix_madvise((void *)start, end - start, POSIX_MADV_WILLNEED);
+#endif
+}
+
+void VirtualMemory::pageFaults(quint64 &minor, quint64 &major) {
+	minor = major = 0;
+#ifndef WIN32
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) == 0) {
+		minor = usage.ru_minflt;
+		major = usage.ru_majflt;
+	}
+#endif
+}
+
 void VirtualMemory::resize(quint64 n, quint64 n_blocks) {
+	if(compressed || in_core) {
+		//the size of the file depends on the compression (or there is no file yet), only the number of blocks matters.
+		for(quint64 i = n_blocks; i < cache.size(); i++) {
+			if(cache[i]) {
+				pins[i] = 0;
+				freeBlock(i, false);
+			}
+		}
+		cache.resize(n_blocks, NULL);
+		heap.resize(n_blocks, 0);
+		pins.resize(n_blocks, 0);
+		policy->resize(n_blocks);
+		if(in_core)
+			core_size = n;
+		if(compressed)
+			slots.resize(n_blocks);
+		if(compressed && !n_blocks) {
+			QTemporaryFile::resize(0);
+			file_end = 0;
+		}
+		return;
+	}
 #ifndef WIN32
 	if(n < (quint64)size())
 		flush();
@@ -69,6 +182,9 @@ void VirtualMemory::resize(quint64 n, quint64 n_blocks) {
 	flush();
 #endif
 	cache.resize(n_blocks, NULL);
+	heap.resize(n_blocks, 0);
+	pins.resize(n_blocks, 0);
+	policy->resize(n_blocks);
 	QTemporaryFile::resize(n);
 #ifdef WIN32
 	/*for (qint64 i = 0; i < cache.size(); i++)
@@ -81,6 +197,15 @@ quint64 VirtualMemory::addBlock(quint64 length) {
 	flush();
 #endif
 	cache.push_back(NULL);
+	heap.push_back(0);
+	pins.push_back(0);
+	policy->resize(cache.size());
+	if(compressed)
+		slots.push_back(Slot()); //space is allocated when written
+	if(in_core)
+		core_size += length;
+	if(compressed || in_core)
+		return cache.size()-1;
 	QFile::resize(size() + length);
 #ifdef WIN32
 	/*for (qint64 i = 0; i < cache.size(); i++)
@@ -90,39 +215,261 @@ quint64 VirtualMemory::addBlock(quint64 length) {
 }
 
 void VirtualMemory::flush() {
+	if(in_core) { //nowhere to write to
+		pins.assign(pins.size(), 0);
+		return;
+	}
 	for(quint32 i = 0; i < cache.size(); i++) {
 		if(cache[i])
 			unmapBlock(i);
 	}
-	mapped.clear();
+	pins.assign(pins.size(), 0);
+	policy->clear();
+	used_memory = 0;
+}
+
+void VirtualMemory::discard() {
+	if(!compressed && !in_core) {
+		flush();
+		return;
+	}
+	for(quint32 i = 0; i < cache.size(); i++) {
+		if(cache[i])
+			freeBlock(i, false);
+	}
+	pins.assign(pins.size(), 0);
+	policy->clear();
 	used_memory = 0;
 }
 
 void VirtualMemory::makeRoom() {
+	if(in_core && used_memory > max_memory)
+		spill();
 	while(used_memory > max_memory) {
-		assert(mapped.size());
-		quint64 block = mapped.back();
-		if(cache[block])
-			unmapBlock(block);
-		mapped.pop_back();
+		qint64 block = policy->victim(pins);
+		if(block < 0) //everything is pinned: go over budget.
+			break;
+		unmapBlock(block);
 	}
 }
 
+//the blocks already in RAM are not moved (they might be pinned): they are written when unmapped.
+void VirtualMemory::spill() {
+	in_core = false;
+	if(!compressed)
+		QTemporaryFile::resize(core_size);
+	counters.spills++;
+}
+
+//blocks are aligned to the huge page size when large enough: transparent huge pages save a lot of TLB misses.
+static const quint64 HUGE_PAGE = 1<<21;
+
+static uchar *allocBlock(quint64 length, bool zero) {
+#ifdef __linux__
+	if(length >= HUGE_PAGE) {
+		void *buffer = NULL;
+		if(posix_memalign(&buffer, HUGE_PAGE, length) != 0)
+			return NULL;
+		madvise(buffer, length, MADV_HUGEPAGE); //just a hint
+		if(zero)
+			memset(buffer, 0, length);
+		return (uchar *)buffer;
+	}
+#endif
+	return (uchar *)(zero ? calloc(length, 1) : malloc(length));
+}
+
 uchar *VirtualMemory::mapBlock(quint64 block) {
-	quint64 offset = blockOffset(block);
 	quint64 length = blockSize(block);
-	assert(offset + length <= (quint64)QFile::size());
-	cache[block] = map(offset, length);
+	if(in_core && used_memory + length > max_memory)
+		spill();
+
+	if(in_core) {
+		cache[block] = allocBlock(length, true); //as a freshly resized file
+		if(!cache[block])
+			return NULL;
+		heap[block] = 1;
+	} else if(compressed) {
+		Slot &slot = slots[block];
+		uchar *buffer = allocBlock(length, !slot.length);
+		if(!buffer)
+			return NULL;
+		if(slot.length) {
+			scratch.resize(slot.length);
+			if(!seek(slot.offset) || read((char *)scratch.data(), slot.length) != slot.length) {
+				free(buffer);
+				return NULL;
+			}
+			if(!BlockCodec::decompress(scratch.data(), slot.length, buffer, length)) {
+				free(buffer);
+				throw QString("corrupted compressed block in " + fileName());
+			}
+		}
+		cache[block] = buffer;
+		heap[block] = 1;
+	} else {
+		quint64 offset = blockOffset(block);
+		assert(offset + length <= (quint64)QFile::size());
+		cache[block] = map(offset, length);
+		if(!cache[block])
+			return NULL;
+	}
 	used_memory += length;
+	counters.maps++;
+	policy->insert(block);
 	return cache[block];
 }
 
 void VirtualMemory::unmapBlock(quint64 block) {
+	freeBlock(block, true);
+}
+
+//store: blocks in RAM are written back (mapped blocks are always).
+void VirtualMemory::freeBlock(quint64 block, bool store) {
 	assert(block < cache.size());
 	assert(cache[block]);
-	unmap(cache[block]);
+	if(in_core && store) //stays in RAM until discarded
+		return;
+
+	if(heap[block]) {
+		if(store && compressed) {
+			quint64 length = blockSize(block);
+			scratch.resize(BlockCodec::bound(length));
+			quint32 size = BlockCodec::compress(cache[block], length, scratch.data());
+			Slot &slot = slots[block];
+			if(size > slot.capacity) { //the old slot is lost, leave some room to grow in the new one.
+				slot.offset = file_end;
+				slot.capacity = size + size/8;
+				file_end += slot.capacity;
+			}
+			slot.length = size;
+			if(!seek(slot.offset) || write((char *)scratch.data(), size) != size)
+				throw QString("failed writing compressed block in " + fileName() + ": " + errorString());
+			counters.raw_bytes += length;
+			counters.stored_bytes += size;
+		} else if(store) { //in RAM since before the spill
+			qint64 length = blockSize(block);
+			if(!seek(blockOffset(block)) || write((char *)cache[block], length) != length)
+				throw QString("failed writing block in " + fileName() + ": " + errorString());
+		}
+		free(cache[block]);
+		heap[block] = 0;
+	} else
+		unmap(cache[block]);
 	cache[block] = NULL;
 	used_memory -= blockSize(block);
+	counters.unmaps++;
+	policy->remove(block);
+}
+
+//LRU
+
+void LRUPolicy::resize(quint64 n_blocks) {
+	//blocks beyond n_blocks have already been unmapped
+	prev.resize(n_blocks, -1);
+	next.resize(n_blocks, -1);
+	listed.resize(n_blocks, 0);
+}
+
+void LRUPolicy::clear() {
+	prev.assign(prev.size(), -1);
+	next.assign(next.size(), -1);
+	listed.assign(listed.size(), 0);
+	head = tail = -1;
+}
+
+void LRUPolicy::insert(quint64 block) {
+	if(listed[block])
+		unlink(block);
+	pushFront(block);
+}
+
+void LRUPolicy::touch(quint64 block) {
+	if(head == (qint64)block) //most common case: same block accessed again.
+		return;
+	unlink(block);
+	pushFront(block);
+}
+
+void LRUPolicy::remove(quint64 block) {
+	if(listed[block])
+		unlink(block);
+}
+
+qint64 LRUPolicy::victim(const std::vector<quint32> &pins) {
+	for(qint64 block = tail; block != -1; block = prev[block])
+		if(!pins[block])
+			return block;
+	return -1;
+}
+
+void LRUPolicy::unlink(quint64 block) {
+	assert(listed[block]);
+	qint64 p = prev[block];
+	qint64 n = next[block];
+	if(p != -1) next[p] = n; else head = n;
+	if(n != -1) prev[n] = p; else tail = p;
+	prev[block] = next[block] = -1;
+	listed[block] = 0;
+}
+
+void LRUPolicy::pushFront(quint64 block) {
+	prev[block] = -1;
+	next[block] = head;
+	if(head != -1) prev[head] = block;
+	head = block;
+	if(tail == -1) tail = block;
+	listed[block] = 1;
+}
+
+//CLOCK
+
+void ClockPolicy::resize(quint64 n_blocks) {
+	position.resize(n_blocks, -1);
+	referenced.resize(n_blocks, 0);
+}
+
+void ClockPolicy::clear() {
+	ring.clear();
+	position.assign(position.size(), -1);
+	referenced.assign(referenced.size(), 0);
+	hand = 0;
+}
+
+void ClockPolicy::insert(quint64 block) {
+	if(position[block] == -1) {
+		position[block] = ring.size();
+		ring.push_back(block);
+	}
+	referenced[block] = 1;
 }
 
+void ClockPolicy::remove(quint64 block) {
+	qint64 p = position[block];
+	if(p == -1) return;
+	quint64 last = ring.back();
+	ring[p] = last;
+	position[last] = p;
+	ring.pop_back();
+	position[block] = -1;
+	referenced[block] = 0;
+	if(hand >= ring.size())
+		hand = 0;
+}
 
+qint64 ClockPolicy::victim(const std::vector<quint32> &pins) {
+	//two turns are enough to clear all the referenced bits.
+	for(quint64 i = 0; i < 2*ring.size(); i++) {
+		if(hand >= ring.size())
+			hand = 0;
+		quint64 block = ring[hand++];
+		if(pins[block])
+			continue;
+		if(referenced[block]) {
+			referenced[block] = 0;
+			continue;
+		}
+		return block;
+	}
+	return -1;
+}
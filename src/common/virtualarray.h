@@ -21,15 +21,75 @@ for more details.
 #include <assert.h>
 
 #include <QTemporaryFile>
+#include <QMutex>
 
 #include <vector>
-#include <deque>
 #include <iostream>
 
 /*
   blocks are 64 bit memory aligned!
 */
 
+/* decides which mapped block gets unmapped when over the memory budget.
+   Pinned blocks are never chosen. */
+
+class EvictionPolicy {
+public:
+	virtual ~EvictionPolicy() {}
+	virtual void resize(quint64 n_blocks) = 0;
+	virtual void clear() = 0;
+	virtual void insert(quint64 block) = 0; //block has been mapped
+	virtual void touch(quint64 block) = 0;  //mapped block has been accessed
+	virtual void remove(quint64 block) = 0; //block has been unmapped
+	virtual qint64 victim(const std::vector<quint32> &pins) = 0; //-1 if all blocks are pinned
+};
+
+//least recently used: a list of the mapped blocks, most recent in front
+class LRUPolicy: public EvictionPolicy {
+public:
+	void resize(quint64 n_blocks);
+	void clear();
+	void insert(quint64 block);
+	void touch(quint64 block);
+	void remove(quint64 block);
+	qint64 victim(const std::vector<quint32> &pins);
+
+private:
+	std::vector<qint64> prev, next;
+	std::vector<char> listed;
+	qint64 head = -1, tail = -1;
+
+	void unlink(quint64 block);
+	void pushFront(quint64 block);
+};
+
+//second chance: cheaper to touch than LRU, the referenced bit is cleared when the hand passes.
+class ClockPolicy: public EvictionPolicy {
+public:
+	void resize(quint64 n_blocks);
+	void clear();
+	void insert(quint64 block);
+	void touch(quint64 block) { referenced[block] = 1; }
+	void remove(quint64 block);
+	qint64 victim(const std::vector<quint32> &pins);
+
+private:
+	std::vector<quint64> ring;       //mapped blocks
+	std::vector<qint64> position;    //position of the block in ring, -1 if not mapped
+	std::vector<char> referenced;
+	quint64 hand = 0;
+};
+
+struct VirtualMemoryStats {
+	quint64 maps = 0;         //blocks mapped
+	quint64 unmaps = 0;       //blocks unmapped
+	quint64 hits = 0;         //access to an already mapped block
+	quint64 prefetches = 0;   //prefetch hints issued
+	quint64 raw_bytes = 0;    //compressed mode: bytes of the blocks written
+	quint64 stored_bytes = 0; //compressed mode: bytes actually written in the file
+	quint64 spills = 0;       //1 if an in core memory went over budget and started using the file
+};
+
 class VirtualMemory: public QTemporaryFile {
 public:
 	VirtualMemory(QString prefix);
@@ -38,15 +98,39 @@ public:
 	quint64 memoryUsed() { return used_memory; }
 	quint64 maxMemory() { return max_memory; }
 	void setMaxMemory(quint64 max_memory);
+	void setEvictionPolicy(EvictionPolicy *policy); //takes ownership, default is LRU
+	//blocks live in RAM and are compressed into the file when unmapped, instead of being mapped.
+	//must be set before adding blocks. Memory used is still counted uncompressed.
+	void setCompressed(bool on);
+	bool isCompressed() { return compressed; }
+	//default: blocks are allocated in RAM, without touching the file, until they exceed the memory budget.
+	//then the memory spills to the file (mapped or compressed). Must be set before adding blocks.
+	void setInCore(bool on);
+	bool isInCore() { return in_core; }
 
-	//careful: if unload is false, memory is valid until another call to a function of this classe
-	uchar *getBlock(quint64 block, bool unload = false);
+	//careful: memory is valid until another call to a function of this class, unless the block is pinned
+	uchar *getBlock(quint64 block);
 	void dropBlock(quint64 block);
 	quint64 addBlock(quint64 length);         //return index of added block
 
+	//pinned blocks are never unmapped to make room, pins are counted
+	uchar *pinBlock(quint64 block);
+	void unpinBlock(quint64 block);
+	//hint the block will be needed soon: it gets mapped and read ahead asynchronously.
+	void prefetchBlock(quint64 block);
+
+	//thread safe versions of pin/unpin, memory is valid until released.
+	//the other functions should not be called while other threads hold blocks.
+	uchar *acquireBlock(quint64 block);
+	void releaseBlock(quint64 block, bool drop = false); //drop unmaps the block if nobody else holds it
+
 	quint64 nBlocks() { return cache.size(); }
 	void resize(quint64 size, quint64 n_blocks);
 	void flush();
+	void discard(); //as flush, but compressed blocks are not written back: the content is not needed anymore
+
+	const VirtualMemoryStats &stats() { return counters; }
+	static void pageFaults(quint64 &minor, quint64 &major); //for the whole process
 
 protected:
 
@@ -56,12 +140,68 @@ protected:
 	uchar *mapBlock(quint64 block);
 	void unmapBlock(quint64 block);
 	void makeRoom();
+	void freeBlock(quint64 block, bool store);
+	void spill();
+
+	QMutex m_cache;               //used only by the thread safe functions
 
 private:
 	quint64 used_memory;
 	quint64 max_memory;
 	std::vector<uchar *> cache;   //1 pointer per block Nu
-	std::deque<quint64> mapped;
+	std::vector<char> heap;       //the block was allocated instead of mapped
+	std::vector<quint32> pins;    //pin count per block
+	EvictionPolicy *policy;
+	VirtualMemoryStats counters;
+
+	struct Slot {                 //where a compressed block is in the file
+		quint64 offset = 0;
+		quint32 length = 0;       //0 if never written
+		quint32 capacity = 0;
+	};
+	bool compressed = false;
+	bool in_core = true;
+	quint64 core_size = 0;        //size the file will need when spilling
+	std::vector<Slot> slots;      //1 per block, compressed mode only
+	quint64 file_end = 0;         //slots are allocated at the end of the file when they grow
+	std::vector<uchar> scratch;   //compressed data
+};
+
+//keeps a block mapped while alive, see acquireBlock.
+class BlockHandle {
+public:
+	uchar *data;
+
+	BlockHandle(): data(NULL), memory(NULL), block(0) {}
+	BlockHandle(VirtualMemory *m, quint64 b): data(m->acquireBlock(b)), memory(m), block(b) {}
+	BlockHandle(BlockHandle &&h): data(h.data), memory(h.memory), block(h.block) {
+		h.data = NULL;
+		h.memory = NULL;
+	}
+	BlockHandle &operator=(BlockHandle &&h) {
+		release();
+		std::swap(data, h.data);
+		std::swap(memory, h.memory);
+		std::swap(block, h.block);
+		return *this;
+	}
+	~BlockHandle() { release(); }
+
+	quint64 index() const { return block; }
+
+	void release(bool drop = false) {
+		if(memory)
+			memory->releaseBlock(block, drop);
+		data = NULL;
+		memory = NULL;
+	}
+
+private:
+	VirtualMemory *memory;
+	quint64 block;
+
+	BlockHandle(const BlockHandle &);
+	BlockHandle &operator=(const BlockHandle &);
 };
 
 
@@ -70,7 +210,7 @@ public:
 	VirtualArray(QString prefix): VirtualMemory(prefix), n_elements(0), elements_per_block(1<<16) {
 		block_size = elements_per_block * sizeof(ITEM);
 	}
-	~VirtualArray() { flush(); }
+	~VirtualArray() { discard(); }
 
 	void setElementsPerBlock(quint64 n) {
 		elements_per_block = n;
@@ -93,6 +233,14 @@ public:
 		uchar *buffer = getBlock(block);
 		return *(ITEM *)(buffer + offset * sizeof(ITEM));
 	}
+	//thread safe, the handle keeps the block mapped and is reused while n falls in the same block.
+	ITEM &at(quint64 n, BlockHandle &handle) {
+		quint64 block = n / elements_per_block;
+		quint64 offset = n - block * elements_per_block;
+		if(!handle.data || handle.index() != block)
+			handle = BlockHandle(this, block);
+		return *(ITEM *)(handle.data + offset * sizeof(ITEM));
+	}
 
 protected:
 	quint64 n_elements;           //number of elements
@@ -108,17 +256,27 @@ public:
 	VirtualChunks(QString prefix): VirtualMemory(prefix), padding(64) {
 		offsets.push_back(0);
 	}
-	~VirtualChunks() { flush(); }
+	~VirtualChunks() { discard(); }
 	void setPadding(quint32 p) { padding = p; }
+	void clear() {
+		resize(0, 0);
+		offsets.assign(1, 0);
+	}
 
+	//thread safe
 	quint64 addChunk(quint64 size) {
 		//pad size:
 		size = pad(size);
+		QMutexLocker locker(&m_cache); //mapping other chunks reads the offsets
 		offsets.push_back(offsets.back() + size);
 		addBlock(size);
 		return offsets.size() -2;
 	}
-	uchar *getChunk(quint64 chunk, bool unload = false) { return getBlock(chunk, unload); }
+	uchar *getChunk(quint64 chunk) { return getBlock(chunk); }
+	uchar *pinChunk(quint64 chunk) { return pinBlock(chunk); }
+	void unpinChunk(quint64 chunk) { unpinBlock(chunk); }
+	void prefetchChunk(quint64 chunk) { prefetchBlock(chunk); }
+	BlockHandle acquireChunk(quint64 chunk) { return BlockHandle(this, chunk); }
 	void dropChunk(quint64 chunk) { unmapBlock(chunk); }
 
 	quint64 chunkSize(quint64 chunk) { return blockSize(chunk); }
@@ -0,0 +1,80 @@
+/*
+Nexus
+
+Copyright(C) 2012 - Federico Ponchio
+ISTI - Italian National Research Council - Visual Computing Lab
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
+for more details.
+*/
+#ifndef NX_CHECKPOINT_H
+#define NX_CHECKPOINT_H
+
+#include <QFile>
+#include <QString>
+
+#include <vector>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+/* raw binary helpers for the checkpoint files: the checkpoint is reloaded by the same build
+   on the same machine, so structures are dumped as they are in memory. */
+
+template <class T> void writeValue(QFile &file, const T &value) {
+	if(file.write((const char *)&value, sizeof(T)) != sizeof(T))
+		throw QString("failed writing checkpoint %1: %2").arg(file.fileName()).arg(file.errorString());
+}
+
+template <class T> void readValue(QFile &file, T &value) {
+	if(file.read((char *)&value, sizeof(T)) != sizeof(T))
+		throw QString("truncated checkpoint: %1").arg(file.fileName());
+}
+
+template <class T> void writeVector(QFile &file, const std::vector<T> &v) {
+	quint64 n = v.size();
+	writeValue(file, n);
+	qint64 size = sizeof(T)*n;
+	if(n && file.write((const char *)v.data(), size) != size)
+		throw QString("failed writing checkpoint %1: %2").arg(file.fileName()).arg(file.errorString());
+}
+
+template <class T> void readVector(QFile &file, std::vector<T> &v) {
+	quint64 n;
+	readValue(file, n);
+	v.resize(n);
+	qint64 size = sizeof(T)*n;
+	if(n && file.read((char *)v.data(), size) != size)
+		throw QString("truncated checkpoint: %1").arg(file.fileName());
+}
+
+inline void writeString(QFile &file, const QString &s) {
+	QByteArray utf8 = s.toUtf8();
+	std::vector<char> v(utf8.begin(), utf8.end());
+	writeVector(file, v);
+}
+
+inline void readString(QFile &file, QString &s) {
+	std::vector<char> v;
+	readVector(file, v);
+	s = QString::fromUtf8(v.data(), (int)v.size());
+}
+
+//make sure data reached the disk before the checkpoint is committed.
+inline void syncFile(QFile &file) {
+	file.flush();
+#ifndef WIN32
+	fsync(file.handle());
+#endif
+}
+
+#endif // NX_CHECKPOINT_H
@@ -0,0 +1,412 @@
+/*
+Nexus
+
+Copyright(C) 2012 - Federico Ponchio
+ISTI - Italian National Research Council - Visual Computing Lab
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
+for more details.
+*/
+#include "flatsimplifier.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <numeric>
+#include <math.h>
+
+static const quint32 MIN_PART_TRIANGLES = 4096; //smaller parts would be mostly locked border
+
+void FlatSimplifier::Quadric::addPlane(double a, double b, double c, double d, double w) {
+	q[0] += w*a*a; q[1] += w*a*b; q[2] += w*a*c; q[3] += w*a*d;
+	q[4] += w*b*b; q[5] += w*b*c; q[6] += w*b*d;
+	q[7] += w*c*c; q[8] += w*c*d;
+	q[9] += w*d*d;
+}
+
+double FlatSimplifier::Quadric::eval(const vcg::Point3f &p) const {
+	double x = p[0], y = p[1], z = p[2];
+	return q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x
+			+ q[4]*y*y + 2*q[5]*y*z + 2*q[6]*y
+			+ q[7]*z*z + 2*q[8]*z
+			+ q[9];
+}
+
+void FlatSimplifier::simplify(quint32 target) {
+	if(nTriangles() <= target)
+		return;
+	quint32 nvert = positions.size();
+	locked.resize(nvert, 0);
+	mark.assign(nvert, 0);
+	stamp = 0;
+
+	std::vector<Edge> edges;
+	std::vector<char> border;
+	findEdges(edges, border);
+	computeQuadrics(edges);
+
+	std::vector<Collapse> collapses;
+	std::vector<quint32> remap(nvert);
+	std::vector<char> touched(nvert);
+
+	while(nTriangles() > target) {
+		quint32 ntriangles = nTriangles();
+		buildAdjacency();
+
+		collapses.clear();
+		for(Edge &e: edges) {
+			Quadric q = quadrics[e.a];
+			q.add(quadrics[e.b]);
+			//a vertex on an open border can only slide along it.
+			bool move_a = !locked[e.a] && (!border[e.a] || e.border);
+			bool move_b = !locked[e.b] && (!border[e.b] || e.border);
+			double cost_a = move_a ? q.eval(positions[e.b]) : 0; //a collapses on b
+			double cost_b = move_b ? q.eval(positions[e.a]) : 0;
+			if(move_a && (!move_b || cost_a <= cost_b))
+				collapses.push_back(Collapse{ std::max(0.0, cost_a), e.a, e.b });
+			else if(move_b)
+				collapses.push_back(Collapse{ std::max(0.0, cost_b), e.b, e.a });
+		}
+		if(!collapses.size())
+			break;
+
+		std::sort(collapses.begin(), collapses.end());
+		quint32 goal = std::max<quint32>(1, (ntriangles - target + 1)/2); //an interior collapse removes 2 triangles
+		double limit = collapses[std::min<size_t>(goal, collapses.size()) - 1].cost*error_slack;
+
+		for(quint32 i = 0; i < nvert; i++)
+			remap[i] = i;
+		std::fill(touched.begin(), touched.end(), 0);
+
+		quint32 removed = 0;
+		quint32 done = 0;
+		for(Collapse &c: collapses) {
+			if(removed >= ntriangles - target)
+				break;
+			if(done && c.cost > limit)
+				break;
+			if(touched[c.from] || touched[c.to])
+				continue;
+
+			quint32 shared = 0;
+			if(!linkCondition(c.from, c.to, shared) || flips(c.from, c.to))
+				continue;
+
+			quadrics[c.to].add(quadrics[c.from]);
+			remap[c.from] = c.to;
+			removed += shared;
+			done++;
+
+			//the triangles around from change: collapses touching them wait for the next pass.
+			touched[c.to] = 1;
+			for(quint32 j = offsets[c.from]; j < offsets[c.from+1]; j++) {
+				quint32 t = adjacency[j];
+				for(int k = 0; k < 3; k++)
+					touched[indices[t*3 + k]] = 1;
+			}
+		}
+		if(!done)
+			break;
+
+		quint32 n = 0;
+		for(quint32 t = 0; t < ntriangles; t++) {
+			quint32 a = remap[indices[t*3]];
+			quint32 b = remap[indices[t*3 + 1]];
+			quint32 c = remap[indices[t*3 + 2]];
+			if(a == b || b == c || c == a)
+				continue;
+			indices[n*3] = a;
+			indices[n*3 + 1] = b;
+			indices[n*3 + 2] = c;
+			n++;
+		}
+		indices.resize(n*3);
+		findEdges(edges, border);
+	}
+}
+
+void FlatSimplifier::simplify(quint32 target, int n_threads) {
+	quint32 parts = std::min<quint32>(std::max(n_threads, 1), nTriangles()/MIN_PART_TRIANGLES);
+	if(parts > 1 && target < nTriangles()) {
+		std::vector<char> cut = simplifyParts(target, parts);
+		simplifyCuts(cut, target);
+	}
+	simplify(target); //whatever the border pass could not remove
+}
+
+//border pass: the vertices around the cuts can move, only the triangles touching them are simplified.
+void FlatSimplifier::simplifyCuts(const std::vector<char> &cut, quint32 target) {
+	if(nTriangles() <= target)
+		return;
+	quint32 nvert = positions.size();
+	std::vector<char> movable(cut);
+	for(quint32 t = 0; t < nTriangles(); t++) {
+		const quint32 *f = &indices[t*3];
+		if(cut[f[0]] || cut[f[1]] || cut[f[2]])
+			movable[f[0]] = movable[f[1]] = movable[f[2]] = 1;
+	}
+
+	//the movable vertices have all their triangles in the sub mesh, collapses are checked as in the whole mesh.
+	FlatSimplifier sub;
+	sub.border_weight = border_weight;
+	sub.error_slack = error_slack;
+	std::vector<quint32> local(nvert, 0xffffffff);
+	std::vector<quint32> global;
+	quint32 kept = 0;
+	for(quint32 t = 0; t < nTriangles(); t++) {
+		const quint32 *f = &indices[t*3];
+		if(!movable[f[0]] && !movable[f[1]] && !movable[f[2]]) {
+			for(int k = 0; k < 3; k++)
+				indices[kept*3 + k] = f[k];
+			kept++;
+			continue;
+		}
+		for(int k = 0; k < 3; k++) {
+			quint32 v = f[k];
+			if(local[v] == 0xffffffff) {
+				local[v] = sub.positions.size();
+				sub.positions.push_back(positions[v]);
+				sub.locked.push_back(locked[v] || !movable[v]);
+				global.push_back(v);
+			}
+			sub.indices.push_back(local[v]);
+		}
+	}
+	quint32 excess = nTriangles() - target;
+	sub.simplify(sub.nTriangles() > excess ? sub.nTriangles() - excess : 0);
+
+	indices.resize(kept*3);
+	for(quint32 v: sub.indices)
+		indices.push_back(global[v]);
+}
+
+//collapses never move vertices: the parts share positions and merging is just remapping indices.
+//returns the vertices shared between parts.
+std::vector<char> FlatSimplifier::simplifyParts(quint32 target, int parts) {
+	quint32 nvert = positions.size();
+	quint32 ntriangles = nTriangles();
+	locked.resize(nvert, 0);
+
+	//slabs along the longest axis of the box, sorting the triangles by centroid.
+	vcg::Point3f min = positions[indices[0]], max = min;
+	for(quint32 v: indices) {
+		for(int k = 0; k < 3; k++) {
+			min[k] = std::min(min[k], positions[v][k]);
+			max[k] = std::max(max[k], positions[v][k]);
+		}
+	}
+	vcg::Point3f size = max - min;
+	int axis = (size[0] >= size[1] && size[0] >= size[2]) ? 0 : (size[1] >= size[2] ? 1 : 2);
+	std::vector<float> centroid(ntriangles);
+	for(quint32 t = 0; t < ntriangles; t++)
+		centroid[t] = positions[indices[t*3]][axis] + positions[indices[t*3 + 1]][axis] + positions[indices[t*3 + 2]][axis];
+	std::vector<quint32> order(ntriangles);
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](quint32 a, quint32 b) { return centroid[a] < centroid[b]; });
+
+	//vertices used by more than one part are locked until the final pass.
+	std::vector<qint32> owner(nvert, -1);
+	std::vector<char> cut(nvert, 0);
+	for(quint32 i = 0; i < ntriangles; i++) {
+		qint32 part = (quint64)i*parts/ntriangles;
+		for(int k = 0; k < 3; k++) {
+			quint32 v = indices[order[i]*3 + k];
+			if(owner[v] == -1)
+				owner[v] = part;
+			else if(owner[v] != part)
+				cut[v] = 1;
+		}
+	}
+
+	//triangles around the cuts are left for the final pass, as they would be if the cut was not there.
+	std::vector<quint32> around(parts, 0);
+	for(quint32 i = 0; i < ntriangles; i++) {
+		const quint32 *f = &indices[order[i]*3];
+		if(cut[f[0]] || cut[f[1]] || cut[f[2]])
+			around[(quint64)i*parts/ntriangles]++;
+	}
+	double ratio = target/(double)ntriangles;
+
+	std::vector<FlatSimplifier> simplifiers(parts);
+	std::vector<std::vector<quint32>> global(parts); //local to global vertex index
+	parallelFor(0, parts, parts, [&](qint64 start, qint64 end) {
+		std::vector<quint32> local(nvert, 0xffffffff);
+		for(qint64 p = start; p < end; p++) {
+			FlatSimplifier &part = simplifiers[p];
+			part.border_weight = border_weight;
+			part.error_slack = error_slack;
+			quint32 first = (quint64)p*ntriangles/parts;
+			quint32 last = (quint64)(p+1)*ntriangles/parts;
+			for(quint32 i = first; i < last; i++) {
+				for(int k = 0; k < 3; k++) {
+					quint32 v = indices[order[i]*3 + k];
+					if(local[v] == 0xffffffff) {
+						local[v] = part.positions.size();
+						part.positions.push_back(positions[v]);
+						part.locked.push_back(locked[v] || cut[v]);
+						global[p].push_back(v);
+					}
+					part.indices.push_back(local[v]);
+				}
+			}
+			for(quint32 v: global[p])
+				local[v] = 0xffffffff;
+			part.simplify((last - first)*ratio + around[p]*(1 - ratio));
+		}
+	}, 1);
+
+	indices.clear();
+	for(int p = 0; p < parts; p++)
+		for(quint32 v: simplifiers[p].indices)
+			indices.push_back(global[p][v]);
+	return cut;
+}
+
+void FlatSimplifier::findEdges(std::vector<Edge> &edges, std::vector<char> &border) {
+	std::vector<quint64> keys;
+	keys.reserve(indices.size());
+	for(quint32 t = 0; t < nTriangles(); t++) {
+		for(int k = 0; k < 3; k++) {
+			quint64 a = indices[t*3 + k];
+			quint64 b = indices[t*3 + (k+1)%3];
+			keys.push_back(a < b ? (a<<32) | b : (b<<32) | a);
+		}
+	}
+	std::sort(keys.begin(), keys.end());
+
+	edges.clear();
+	border.assign(positions.size(), 0);
+	for(size_t i = 0; i < keys.size();) {
+		size_t j = i + 1;
+		while(j < keys.size() && keys[j] == keys[i])
+			j++;
+		Edge e;
+		e.a = keys[i]>>32;
+		e.b = keys[i] & 0xffffffff;
+		e.border = (j - i == 1);
+		if(e.border)
+			border[e.a] = border[e.b] = 1;
+		edges.push_back(e);
+		i = j;
+	}
+}
+
+void FlatSimplifier::computeQuadrics(const std::vector<Edge> &edges) {
+	quadrics.assign(positions.size(), Quadric());
+	std::vector<vcg::Point3f> normals(nTriangles());
+	for(quint32 t = 0; t < nTriangles(); t++) {
+		const vcg::Point3f &p0 = positions[indices[t*3]];
+		const vcg::Point3f &p1 = positions[indices[t*3 + 1]];
+		const vcg::Point3f &p2 = positions[indices[t*3 + 2]];
+		vcg::Point3f n = (p1 - p0)^(p2 - p0);
+		double area = n.Norm();
+		if(area == 0) {
+			normals[t] = vcg::Point3f(0, 0, 0);
+			continue;
+		}
+		n /= area;
+		normals[t] = n;
+		double d = -(n*p0);
+		for(int k = 0; k < 3; k++)
+			quadrics[indices[t*3 + k]].addPlane(n[0], n[1], n[2], d, area/2);
+	}
+
+	//open borders: a plane through the edge perpendicular to its triangle.
+	if(border_weight <= 0)
+		return;
+	for(quint32 t = 0; t < nTriangles(); t++) {
+		for(int k = 0; k < 3; k++) {
+			quint32 a = indices[t*3 + k];
+			quint32 b = indices[t*3 + (k+1)%3];
+			Edge key = { std::min(a, b), std::max(a, b), false };
+			auto it = std::lower_bound(edges.begin(), edges.end(), key, [](const Edge &x, const Edge &y) {
+				return x.a < y.a || (x.a == y.a && x.b < y.b);
+			});
+			if(it == edges.end() || !it->border)
+				continue;
+			vcg::Point3f edge = positions[b] - positions[a];
+			vcg::Point3f n = edge^normals[t];
+			float len = n.Norm();
+			if(len == 0)
+				continue;
+			n /= len;
+			double d = -(n*positions[a]);
+			double w = border_weight*edge.SquaredNorm();
+			quadrics[a].addPlane(n[0], n[1], n[2], d, w);
+			quadrics[b].addPlane(n[0], n[1], n[2], d, w);
+		}
+	}
+}
+
+void FlatSimplifier::buildAdjacency() {
+	quint32 nvert = positions.size();
+	offsets.assign(nvert + 1, 0);
+	for(quint32 i = 0; i < indices.size(); i++)
+		offsets[indices[i] + 1]++;
+	for(quint32 i = 0; i < nvert; i++)
+		offsets[i+1] += offsets[i];
+	adjacency.resize(indices.size());
+	std::vector<quint32> fill(offsets.begin(), offsets.end() - 1);
+	for(quint32 i = 0; i < indices.size(); i++)
+		adjacency[fill[indices[i]]++] = i/3;
+}
+
+//the vertices adjacent to both must be the ones opposite to the shared edge, otherwise the collapse is not manifold.
+bool FlatSimplifier::linkCondition(quint32 from, quint32 to, quint32 &shared) {
+	quint32 ring = ++stamp;
+	for(quint32 j = offsets[from]; j < offsets[from+1]; j++) {
+		quint32 t = adjacency[j];
+		bool has_to = false;
+		for(int k = 0; k < 3; k++) {
+			quint32 v = indices[t*3 + k];
+			mark[v] = ring;
+			has_to |= (v == to);
+		}
+		shared += has_to;
+	}
+	quint32 counted = ++stamp;
+	quint32 common = 0;
+	for(quint32 j = offsets[to]; j < offsets[to+1]; j++) {
+		quint32 t = adjacency[j];
+		for(int k = 0; k < 3; k++) {
+			quint32 v = indices[t*3 + k];
+			if(v == from || v == to) continue;
+			if(mark[v] == ring) {
+				common++;
+				mark[v] = counted;
+			}
+		}
+	}
+	return shared > 0 && common == shared;
+}
+
+bool FlatSimplifier::flips(quint32 from, quint32 to) {
+	const vcg::Point3f &target = positions[to];
+	for(quint32 j = offsets[from]; j < offsets[from+1]; j++) {
+		quint32 t = adjacency[j];
+		const quint32 *f = &indices[t*3];
+		if(f[0] == to || f[1] == to || f[2] == to)
+			continue; //removed
+
+		vcg::Point3f p[3], q[3];
+		for(int k = 0; k < 3; k++) {
+			p[k] = positions[f[k]];
+			q[k] = (f[k] == from) ? target : p[k];
+		}
+		vcg::Point3f before = (p[1] - p[0])^(p[2] - p[0]);
+		vcg::Point3f after = (q[1] - q[0])^(q[2] - q[0]);
+		//more than 60 degrees is a flip, slivers have an unreliable normal.
+		float after_area = after.Norm();
+		float perimeter2 = (q[1] - q[0]).SquaredNorm() + (q[2] - q[1]).SquaredNorm() + (q[0] - q[2]).SquaredNorm();
+		if(before*after <= 0.5f*before.Norm()*after_area || after_area <= 1e-3f*perimeter2)
+			return true;
+	}
+	return false;
+}
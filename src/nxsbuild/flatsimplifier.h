@@ -0,0 +1,79 @@
+/*
+Nexus
+
+Copyright(C) 2012 - Federico Ponchio
+ISTI - Italian National Research Council - Visual Computing Lab
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
+for more details.
+*/
+#ifndef NX_FLATSIMPLIFIER_H
+#define NX_FLATSIMPLIFIER_H
+
+#include <QtGlobal>
+#include <vector>
+
+#include <vcg/space/point3.h>
+
+/* quadric edge collapse on plain arrays (positions, indices and a flat vertex to triangle adjacency) instead of vcg topology.
+   Each pass sorts the candidate edges by cost and collapses the cheapest ones that do not share
+   triangles (an edge collapses onto one of its vertices), then compacts the indices.
+   Locked vertices (block borders) never move, open borders only collapse along themselves. */
+
+class FlatSimplifier {
+public:
+	std::vector<vcg::Point3f> positions;
+	std::vector<quint32> indices;    //3 per triangle
+	std::vector<char> locked;        //one per vertex
+
+	float border_weight = 10.0f;     //of the planes keeping open borders in place
+	float error_slack = 1.5f;        //a pass collapses edges up to this times the cost of the last needed one
+
+	quint32 nTriangles() const { return indices.size()/3; }
+	//stops at target triangles or when nothing else can be collapsed.
+	void simplify(quint32 target);
+	//the mesh is cut in slabs simplified in parallel with the vertices between slabs locked,
+	//a serial pass on the whole mesh then collapses across the cuts.
+	void simplify(quint32 target, int n_threads);
+
+protected:
+	struct Quadric {
+		double q[10] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }; //xx xy xz xw yy yz yw zz zw ww
+		void addPlane(double a, double b, double c, double d, double w);
+		void add(const Quadric &o) { for(int i = 0; i < 10; i++) q[i] += o.q[i]; }
+		double eval(const vcg::Point3f &p) const;
+	};
+	struct Edge {
+		quint32 a, b;
+		bool border;
+	};
+	struct Collapse {
+		double cost;
+		quint32 from, to;
+		bool operator<(const Collapse &c) const { return cost < c.cost; }
+	};
+
+	std::vector<Quadric> quadrics;
+	std::vector<quint32> offsets;    //vertex to triangles adjacency
+	std::vector<quint32> adjacency;
+	std::vector<quint32> mark;       //scratch for the link condition
+	quint32 stamp = 0;
+
+	std::vector<char> simplifyParts(quint32 target, int parts);
+	void simplifyCuts(const std::vector<char> &cut, quint32 target);
+	void findEdges(std::vector<Edge> &edges, std::vector<char> &border);
+	void computeQuadrics(const std::vector<Edge> &edges);
+	void buildAdjacency();
+	bool linkCondition(quint32 from, quint32 to, quint32 &shared);
+	bool flips(quint32 from, quint32 to);
+};
+
+#endif // NX_FLATSIMPLIFIER_H
@@ -16,11 +16,13 @@ GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
 for more details.
 */
 #include <QDebug>
+#include <QMutex>
 
 #include "kdtree.h"
 #include "meshstream.h"
 #include "mesh.h"
 #include "tmesh.h"
+#include "parallel.h"
 
 using namespace std;
 
@@ -68,10 +70,16 @@ void KDTree::load(Stream *stream) {
 
 	textures = stream->textures;
 
+	startLoading(stream->box);
+	loadElements(stream);
+	finishLoading();
+}
+
+void KDTree::startLoading(vcg::Box3f box) {
 	KDCell node;
 	node.block = 0;
 	//the node.box is relative to the axes
-	node.box = computeBox(stream->box);
+	node.box = computeBox(box);
 
 	float precision = boxFloatPrecision(node.box);
 	if(precision < 12) {
@@ -87,9 +95,10 @@ void KDTree::load(Stream *stream) {
 
 	node.block = addBlock();
 	cells.push_back(node);
+}
 
-	loadElements(stream);
-
+void KDTree::finishLoading() {
+	block_boxes.resize((cells.size() + 1)/2); //each leaf owns a block
 	for(quint32 i = 0; i < cells.size(); i++) {
 		if(cells[i].isLeaf()) {
 			int block = cells[i].block;
@@ -97,6 +106,7 @@ void KDTree::load(Stream *stream) {
 		}
 	}
 }
+
 void KDTree::setAxes(vcg::Point3f &x, vcg::Point3f &y, vcg::Point3f &z) {
 	axes[0] = x;
 	axes[1] = y;
@@ -193,7 +203,11 @@ float KDTree::findMiddle(KDCell &node) {
 	}
 
 	findRealMiddle(node);
+	clampMiddle(node);
+	return node.middle;
+}
 
+void KDTree::clampMiddle(KDCell &node) {
 	float min = node.box.min[node.split];
 	float max = node.box.max[node.split];
 	float interval = max - min;
@@ -206,8 +220,6 @@ float KDTree::findMiddle(KDCell &node) {
 
 	if(ratio < min_ratio) node.middle = min + min_ratio*interval;
 	if(ratio > max_ratio) node.middle = min + max_ratio*interval;
-
-	return node.middle;
 }
 
 
@@ -239,14 +251,36 @@ void KDTree::lock(TMesh &mesh, int block) {
 
 //SOUP
 
+//below this size splitting the work among threads is not worth it.
+static const qint64 min_parallel = 8192;
+
 void KDTreeSoup::loadElements(Stream *s) {
 	StreamSoup *stream = dynamic_cast<StreamSoup *>(s);
+	bool weighted = textures.size() && texelWeight > 0;
+
+	std::vector<qint32> leaves;
+	std::vector<quint32> masks;
+	std::vector<double> weights;
 	while(true) {
 		Soup soup = stream->streamTriangles();
 		if(soup.size() == 0) break;
-		for(uint i = 0; i < soup.size(); i++) {
-			pushTriangle(soup[i]);
-		}
+
+		/* descending the tree is done in parallel on the current tree. If a leaf gets split
+		   while pushing the previous triangles, pushTriangle continues the descent from there,
+		   which gives the same result of descending from the root. */
+		leaves.resize(soup.size());
+		masks.resize(soup.size());
+		weights.resize(soup.size());
+		parallelFor(0, soup.size(), n_threads, [&](qint64 start, qint64 end) {
+			for(qint64 i = start; i < end; i++) {
+				masks[i] = 0x7;
+				leaves[i] = findLeaf(soup[i], masks[i]);
+				weights[i] = weighted ? weight(soup[i]) : 0.0;
+			}
+		}, min_parallel);
+
+		for(uint i = 0; i < soup.size(); i++)
+			pushTriangle(soup[i], leaves[i], masks[i], weights[i]);
 	}
 	block_boxes.resize(nBlocks());
 }
@@ -259,90 +293,195 @@ void KDTreeSoup::clear() {
 
 void KDTreeSoup::findRealMiddle(KDCell &node) {
 	Soup soup = get(node.block);
+	findRealMiddle(node, soup.elements, soup.size());
+}
 
+void KDTreeSoup::findRealMiddle(KDCell &node, Triangle *soup, quint32 n) {
 	vcg::Box3f box;
-	for(quint32 i = 0; i < soup.size(); i++) {
-		Triangle &triangle = soup[i];
-		for(int k = 0; k < 3; k++) {
-			vcg::Point3f p(triangle.vertices[k].v);
-			/* computation must be repeatable
-			  Google for What Every Computer Scientist Should Know About Floating-Point Arithmetic
-			  and see
-			  Pitfalls in Computations on Extended-Based Systems
-			  and cry
-			  */
-			volatile float d0 = p*axes[0];
-			volatile float d1 = p*axes[1];
-			volatile float d2 = p*axes[2];
-			box.Add(vcg::Point3f(d0, d1, d2));
+	QMutex mutex;
+	parallelFor(0, n, n_threads, [&](qint64 start, qint64 end) {
+		vcg::Box3f range_box;
+		for(qint64 i = start; i < end; i++) {
+			Triangle &triangle = soup[i];
+			for(int k = 0; k < 3; k++) {
+				vcg::Point3f p(triangle.vertices[k].v);
+				/* computation must be repeatable
+				  Google for What Every Computer Scientist Should Know About Floating-Point Arithmetic
+				  and see
+				  Pitfalls in Computations on Extended-Based Systems
+				  and cry
+				  */
+				volatile float d0 = p*axes[0];
+				volatile float d1 = p*axes[1];
+				volatile float d2 = p*axes[2];
+				range_box.Add(vcg::Point3f(d0, d1, d2));
+			}
 		}
-	}
+		QMutexLocker locker(&mutex);
+		box.Add(range_box);
+	}, min_parallel);
+
 	//find split axis
 	node.split = box.MaxDim();
 
 	vcg::Point3f &axis = axes[node.split];
 
 	std::vector<float> tmp;
-	tmp.resize(soup.size());
+	tmp.resize(n);
 	//use first vertex of triangle for estimating splitting
-	for(quint32 i = 0; i < soup.size(); i++) {
-		vcg::Point3f p(soup[i].vertices[0].v);
-		tmp[i] = p*axis;
-	}
-	std::sort(tmp.begin(), tmp.end());
-	//node.middle = tmp[soup.size()/2];
-	node.middle = tmp[(int)(soup.size()*ratio)];
+	parallelFor(0, n, n_threads, [&](qint64 start, qint64 end) {
+		for(qint64 i = start; i < end; i++) {
+			vcg::Point3f p(soup[i].vertices[0].v);
+			tmp[i] = p*axis;
+		}
+	}, min_parallel);
+
+	//nth_element places in position the same value a full sort would.
+	quint32 middle = (quint32)(n*ratio);
+	std::nth_element(tmp.begin(), tmp.begin() + middle, tmp.end());
+	node.middle = tmp[middle];
 }
 
 void KDTreeSoup::splitNode(KDCell &node, KDCell &child0, KDCell &child1) {
 
-	Soup source = get(child0.block, true);
-	Soup dest = get(child1.block, true);
+	pin(child0.block);
+	pin(child1.block);
+	Soup source = get(child0.block);
+	Soup dest = get(child1.block);
 
-	quint32 n0 = 0;
+	//assign triangles in parallel, then move them in order, as the serial version would.
+	std::vector<uchar> side(source.size());
+	std::vector<double> weights(source.size());
 	vcg::Point3f axis = axes[node.split];
+	parallelFor(0, source.size(), n_threads, [&](qint64 start, qint64 end) {
+		for(qint64 i = start; i < end; i++) {
+			Triangle &t = source[i];
+			quint32 mask = 0;
+			for(int k = 0; k < 3; k ++) {
+				vcg::Point3f p(t.vertices[k].v);
+				if(isIn(node.box, p))
+					mask |= (1<<k);
+			}
+			int c = 0;
+			if(mask != 0)
+				c = assign(t, mask, axis, node.middle);
+			side[i] = c;
+			weights[i] = weight(t);
+		}
+	}, min_parallel);
+
+	quint32 n0 = 0;
 	for(quint32 i = 0; i < source.size(); i++) {
 		Triangle &t = source[i];
-		quint32 mask = 0;
-		for(int k = 0; k < 3; k ++) {
-			vcg::Point3f p(t.vertices[k].v);
-			if(isIn(node.box, p))
-				mask |= (1<<k);
-		}
-		int c = 0;
-		if(mask != 0)
-			c = assign(t, mask, axis, node.middle);
-		double w = weight(t);
-		if(c == 0) {
-			child0.weight += w;
+		if(side[i] == 0) {
+			child0.weight += weights[i];
 			source[n0++] = t;
 		} else {
-			child1.weight += w;
+			child1.weight += weights[i];
 			dest.push_back(t);
 		}
 	}
 	source.resize(n0);
 //	if(source.size() == 0 || dest.size() == 0)
 //		cerr <<  "Degenerate point cloud" << endl;
+	unpin(child0.block);
+	unpin(child1.block);
 	drop(child0.block);
 	drop(child1.block);
 }
 
+/* top down version of the splits of pushTriangle: a cell is split while the triangles it will receive
+   would fill its block, the plane is the one findMiddle would pick on the sample. */
+void KDTreeSoup::presplit(std::vector<Triangle> &sample, double represented) {
+	assert(cells.size() == 1);
+	if(sample.size() < 2)
+		return;
+	std::vector<quint32> masks(sample.size(), 0x7);
+	std::vector<double> weights(sample.size(), 0.0);
+	if(textures.size() && texelWeight > 0)
+		for(size_t i = 0; i < sample.size(); i++)
+			weights[i] = weight(sample[i]);
+
+	//split only what would not fit, as pushTriangle does: leaves end up as full as in a normal load.
+	double max_triangles = triangles_per_block;
+	double max_heavy = max_weight;
+
+	struct Range { qint32 cell; quint32 start, end; };
+	std::vector<Range> stack = { { 0, 0, (quint32)sample.size() } };
+	std::vector<Triangle> side1;
+	std::vector<quint32> side1_masks;
+	std::vector<double> side1_weights;
+	while(stack.size()) {
+		Range range = stack.back();
+		stack.pop_back();
+		quint32 n = range.end - range.start;
+		double w = 0;
+		for(quint32 i = range.start; i < range.end; i++)
+			w += weights[i];
+		bool heavy = max_weight > 0 && w*represented > max_heavy;
+		if(n < 2 || (n*represented <= max_triangles && !heavy))
+			continue;
+
+		KDCell &node = cells[range.cell];
+		findRealMiddle(node, &sample[range.start], n);
+		clampMiddle(node);
+
+		//stable partition: child 0 first
+		side1.clear();
+		side1_masks.clear();
+		side1_weights.clear();
+		quint32 n0 = range.start;
+		vcg::Point3f axis = axes[node.split];
+		for(quint32 i = range.start; i < range.end; i++) {
+			quint32 mask = masks[i];
+			if(assign(sample[i], mask, axis, node.middle) == 0) {
+				sample[n0] = sample[i];
+				masks[n0] = mask;
+				weights[n0] = weights[i];
+				n0++;
+			} else {
+				side1.push_back(sample[i]);
+				side1_masks.push_back(mask);
+				side1_weights.push_back(weights[i]);
+			}
+		}
+		std::copy(side1.begin(), side1.end(), sample.begin() + n0);
+		std::copy(side1_masks.begin(), side1_masks.end(), masks.begin() + n0);
+		std::copy(side1_weights.begin(), side1_weights.end(), weights.begin() + n0);
+
+		KDCell child0, child1;
+		child0.block = node.block;
+		child1.block = addBlock();
+		child0.box = child1.box = node.box;
+		child0.box.max[node.split] = child1.box.min[node.split] = node.middle;
+		node.block = -1;
+		node.children[0] = cells.size();
+		node.children[1] = cells.size() + 1;
+		cells.push_back(child0); //node is not valid anymore
+		cells.push_back(child1);
+
+		qint32 first = cells.size() - 2;
+		stack.push_back({ first + 1, n0, range.end });
+		stack.push_back({ first, range.start, n0 });
+	}
+}
+
 void KDTreeSoup::pushTriangle(Triangle &t) {
 	/* MOVED TO SIMPLIFICATION AND STREAM, because of pointcloud
 	//skip triangle if degenerate
 	if(t.vertices[0] == t.vertices[1] || t.vertices[0] == t.vertices[2] || t.vertices[1] == t.vertices[2])
 		return; */
 
-	quint32 mask = 0x7;   //all inside
-	qint32 node_number = 0;
+	double w = 0;
+	if(textures.size() && texelWeight > 0)
+		w = weight(t);
+	pushTriangle(t, 0, 0x7, w);  //all inside
+}
+
+void KDTreeSoup::pushTriangle(Triangle &t, qint32 node_number, quint32 mask, double w) {
 	do {
 		KDCell &node = cells[node_number];
 		if(node.isLeaf()) {
-
-			double w = 0;
-			if(textures.size() && texelWeight > 0)
-				w = weight(t);
 			uint32_t node_triangles = occupancy[node.block];
 			bool too_large = node_triangles >=triangles_per_block;
 			bool too_small = node_triangles < triangles_per_block/16;
@@ -362,6 +501,17 @@ void KDTreeSoup::pushTriangle(Triangle &t) {
 		}
 	} while(1);
 }
+
+qint32 KDTreeSoup::findLeaf(Triangle &t, quint32 &mask) {
+	qint32 node_number = 0;
+	while(!cells[node_number].isLeaf()) {
+		KDCell &node = cells[node_number];
+		int c = assign(t, mask, axes[node.split], node.middle);
+		node_number = node.children[c];
+	}
+	return node_number;
+}
+
 double KDTreeSoup::weight(Triangle &t) {
 	if(textures.size() == 0)
 		return 0;
@@ -406,13 +556,21 @@ int KDTreeSoup::assign(Triangle &t, quint32 &mask, vcg::Point3f axis, float midd
 
 void KDTreeCloud::loadElements(Stream *s) {
 	StreamCloud *stream = dynamic_cast<StreamCloud *>(s);
+
+	std::vector<qint32> leaves;
 	while(true) {
 		Cloud cloud = stream->streamVertices();
 		if(cloud.size() == 0) break;
-		for(uint i = 0; i < cloud.size(); i++) {
-			const vcg::Point3f &p = cloud[i].v;
-			pushVertex(cloud[i]);
-		}
+
+		//see KDTreeSoup::loadElements
+		leaves.resize(cloud.size());
+		parallelFor(0, cloud.size(), n_threads, [&](qint64 start, qint64 end) {
+			for(qint64 i = start; i < end; i++)
+				leaves[i] = findLeaf(cloud[i]);
+		}, min_parallel);
+
+		for(uint i = 0; i < cloud.size(); i++)
+			pushVertex(cloud[i], leaves[i]);
 	}
 	block_boxes.resize(nBlocks());
 }
@@ -428,15 +586,22 @@ void KDTreeCloud::findRealMiddle(KDCell &node) {
 	Cloud cloud = get(node.block);
 
 	vcg::Box3f box;
-	for(quint32 i = 0; i < cloud.size(); i++) {
-		Vertex &vertex = cloud[i];
-		vcg::Point3f p(vertex.v);
+	QMutex mutex;
+	parallelFor(0, cloud.size(), n_threads, [&](qint64 start, qint64 end) {
+		vcg::Box3f range_box;
+		for(qint64 i = start; i < end; i++) {
+			Vertex &vertex = cloud[i];
+			vcg::Point3f p(vertex.v);
+
+			volatile float d0 = p*axes[0];
+			volatile float d1 = p*axes[1];
+			volatile float d2 = p*axes[2];
+			range_box.Add(vcg::Point3f(d0, d1, d2));
+		}
+		QMutexLocker locker(&mutex);
+		box.Add(range_box);
+	}, min_parallel);
 
-		volatile float d0 = p*axes[0];
-		volatile float d1 = p*axes[1];
-		volatile float d2 = p*axes[2];
-		box.Add(vcg::Point3f(d0, d1, d2));
-	}
 	//find split axis
 	node.split = box.MaxDim();
 
@@ -444,31 +609,43 @@ void KDTreeCloud::findRealMiddle(KDCell &node) {
 
 	std::vector<float> tmp;
 	tmp.resize(cloud.size());
-	//use first vertex of triangle for estimating splitting
-	for(quint32 i = 0; i < cloud.size(); i++) {
-		vcg::Point3f p(cloud[i].v);
-		tmp[i] = p*axis;
-	}
-	std::sort(tmp.begin(), tmp.end());
+	parallelFor(0, cloud.size(), n_threads, [&](qint64 start, qint64 end) {
+		for(qint64 i = start; i < end; i++) {
+			vcg::Point3f p(cloud[i].v);
+			tmp[i] = p*axis;
+		}
+	}, min_parallel);
+
+	quint32 middle = (quint32)(cloud.size()*ratio);
+	std::nth_element(tmp.begin(), tmp.begin() + middle, tmp.end());
 
 	//node.middle = tmp[soup.size()/2];
-	node.middle = tmp[(int)(cloud.size()*ratio)];
+	node.middle = tmp[middle];
 	if(node.middle == box.min[node.split] || node.middle == box.max[node.split])
 		throw "Bad node middle in kdtree.";
 }
 
 void KDTreeCloud::splitNode(KDCell &node, KDCell &child0, KDCell &child1) {
 
-	Cloud source = get(child0.block, true);
-	Cloud dest = get(child1.block, true);
+	pin(child0.block);
+	pin(child1.block);
+	Cloud source = get(child0.block);
+	Cloud dest = get(child1.block);
 
-	quint32 n0 = 0;
+	std::vector<uchar> side(source.size());
 	vcg::Point3f axis = axes[node.split];
+	parallelFor(0, source.size(), n_threads, [&](qint64 start, qint64 end) {
+		for(qint64 i = start; i < end; i++) {
+			vcg::Point3f p(source[i].v);
+			volatile float r = p*axis;
+			side[i] = (r < node.middle)? 0 : 1;
+		}
+	}, min_parallel);
+
+	quint32 n0 = 0;
 	for(quint32 i = 0; i < source.size(); i++) {
 		Splat &v = source[i];
-		vcg::Point3f p(v.v);
-		volatile float r = p*axis;
-		if(r < node.middle)
+		if(side[i] == 0)
 			source[n0++] = v;
 		else
 			dest.push_back(v);
@@ -476,13 +653,17 @@ void KDTreeCloud::splitNode(KDCell &node, KDCell &child0, KDCell &child1) {
 	source.resize(n0);
 //	if(source.size() == 0 || dest.size() == 0)
 //		throw "Degenerate point cloud";
+	unpin(child0.block);
+	unpin(child1.block);
 	drop(child0.block);
 	drop(child1.block);
 }
 
 void KDTreeCloud::pushVertex(Splat &v) {
+	pushVertex(v, 0);
+}
 
-	qint32 node_number = 0;
+void KDTreeCloud::pushVertex(Splat &v, qint32 node_number) {
 	do {
 		KDCell &node = cells[node_number];
 		if(node.isLeaf()) {
@@ -508,5 +689,13 @@ void KDTreeCloud::pushVertex(Splat &v) {
 	} while(1);
 }
 
-
-
+qint32 KDTreeCloud::findLeaf(Splat &v) {
+	qint32 node_number = 0;
+	vcg::Point3f p(v.v);
+	while(!cells[node_number].isLeaf()) {
+		KDCell &node = cells[node_number];
+		volatile float r = p * axes[node.split];
+		node_number = node.children[r >= node.middle ? 1 : 0];
+	}
+	return node_number;
+}
@@ -51,11 +51,15 @@ public:
 	std::vector<KDCell> cells;
 	std::vector<vcg::Box3f> block_boxes;      //bounding box associated to the blocks (leaf nodes)
 	std::vector<LoadTexture> textures;
+	int n_threads = 1;   //threads used for loading and splitting
 
 	KDTree(float adapt = 0.333);
 	virtual ~KDTree() {}
 
 	void load(Stream *stream);
+	//load without a stream: call startLoading, push the elements, then finishLoading.
+	void startLoading(vcg::Box3f box);
+	void finishLoading();
 	virtual void setMaxMemory(quint64 m) = 0;
 	virtual void clear() = 0;
 
@@ -79,6 +83,7 @@ protected:
 
 	void split(int n);
 	float findMiddle(KDCell &node);
+	void clampMiddle(KDCell &node); //keeps the split within adaptive from the center
 	bool isIn(vcg::Box3f &box, vcg::Point3f &p); //check if point is in the box (using axes) semiopen box.
 	vcg::Box3f computeBox(vcg::Box3f &b);
 };
@@ -94,11 +99,19 @@ public:
 	void clear();
 	void pushTriangle(Triangle &t);
 	double weight(Triangle &t);
+	//after startLoading: splits the empty tree as a well mixed input would, each sample standing for represented triangles.
+	//used when the triangles will arrive clustered (see NexusBuilder::createPipelined).
+	void presplit(std::vector<Triangle> &sample, double represented);
 
 protected:
 	quint64 addBlock() { return VirtualTriangleSoup::addBlock(); }
+	//continue descending from node_number, (with mask of vertices still inside).
+	void pushTriangle(Triangle &t, qint32 node_number, quint32 mask, double w);
+	//descend the current tree until a leaf, without modifying it.
+	qint32 findLeaf(Triangle &t, quint32 &mask);
 	void loadElements(Stream *stream);
 	void findRealMiddle(KDCell &node);
+	void findRealMiddle(KDCell &node, Triangle *triangles, quint32 n);
 	void splitNode(KDCell &node, KDCell &child0, KDCell &child1);
 	static int assign(Triangle &t, quint32 &mask, vcg::Point3f axis, float middle);
 };
@@ -112,6 +125,8 @@ public:
 
 protected:
 	quint64 addBlock() { return VirtualVertexCloud::addBlock(); }
+	void pushVertex(Splat &v, qint32 node_number);
+	qint32 findLeaf(Splat &v);
 	void load(StreamSoup &stream);
 	void loadElements(Stream *stream);
 	void findRealMiddle(KDCell &node);
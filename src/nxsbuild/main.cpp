@@ -29,6 +29,7 @@ for more details.
 #include "plyloader.h"
 #include "objloader.h"
 #include "tsploader.h"
+#include "profiler.h"
 
 using namespace std;
 
@@ -45,7 +46,7 @@ int main(int argc, char *argv[]) {
 	int top_node_size = 4096;
 	float vertex_quantization = 0.0f;   //optionally quantize vertices position.
 	int tex_quality(95);                //default jpg texture quality
-	//QString decimation("quadric");      //simplification method
+	QString decimation("quadric");      //simplification method
 	int ram_buffer(2000);               //Mb of ram to use
 	int n_threads = 4;
 	float scaling(0.5);                 //simplification ratio
@@ -67,6 +68,13 @@ int main(int argc, char *argv[]) {
 	bool useOrigTex = false;
 	bool create_pow_two_tex = false;
 	bool deepzoom = false;
+	bool pipelined = false;
+	bool compact = false;
+	bool fused = false;
+	bool compress_temp = false;
+	QString checkpoint;
+	bool resume = false;
+	QString profile;
 
 	//BTREE options
 	QVariant adaptive(0.333f);
@@ -88,7 +96,8 @@ int main(int argc, char *argv[]) {
 	opt.addOption('F', "texel-weight", "texels weight are included in node-face computation", &texel_weight);
 	opt.addOption('t', "top node faces", "number of triangles in the top node, default 4096\n"
 				  "Controls the size of the smallest LOD. Higher values will delay the first rendering but with higher quality.", &top_node_size);
-	//opt.addOption('d', "decimation", "decimation method [quadric, edgelen], default quadric", &decimation);
+	opt.addOption('d', "decimation", "decimation method [quadric, flat], default quadric\n"
+				  "flat is faster on untextured meshes, textured ones always use quadric", &decimation);
 	opt.addOption('s', "scaling", "decimation factor between levels, default 0.5", &scaling);
 	opt.addOption('S', "skiplevels", "decimation skipped for n levels, default 0\n"
 				  "Use for meshes with large textures and very few vertices.", &skiplevels);
@@ -119,6 +128,15 @@ int main(int argc, char *argv[]) {
 	//other options
 	opt.addOption('r', "ram", "max ram used (in MegaBytes), default 2000 (WARNING: just an approximation)", &ram_buffer);
 	opt.addOption('w', "workers", "number of workers: default = 4", &n_threads);
+	opt.addSwitch('P', "pipelined", "partition the next level while the current one is simplified\n"
+				  "Keeps all workers busy, the next tree is split in advance on a sample of the current level. Meshes only.", &pipelined);
+	opt.addSwitch('L', "fused load", "partition the input files directly, without a temporary copy (reads them twice)", &fused);
+	opt.addSwitch('Z', "compact stream", "store the triangles between levels as indexed blocks, less temporary disk traffic", &compact);
+	opt.addSwitch('z', "compress temporary", "compress stream and tree blocks in the temporary files (LZ4 style), trades CPU for disk traffic", &compress_temp);
+	opt.addOption('x', "checkpoint", "directory where the build state is saved after each level", &checkpoint);
+	opt.addSwitch('R', "resume", "resume the build from the last level saved in the checkpoint directory (-x)\n"
+				  "Use the same options as the interrupted build.", &resume);
+	opt.addOption('y', "profile", "save time spent in each phase and waiting on locks in <prefix>.json and <prefix>.trace.json", &profile);
 	opt.addOption('T', "origin", "new origin for the model in the format X:Y:Z", &translate);
 	opt.addOption('W', "scale", "scale vector (after origin subtraction) X:Y:Z", &scalate);
 	opt.addSwitch('G', "center", "set origin in the bounding box center of the input meshes", &center);
@@ -163,6 +181,11 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 
+	if(decimation != "quadric" && decimation != "flat") {
+		cerr << "Unknown decimation method: " << qPrintable(decimation) << ", expecting quadric or flat" << endl;
+		return -1;
+	}
+
 	vcg::Point3d origin(0, 0, 0);
 	if(!translate.isEmpty()) {
 		QStringList p = translate.split(':');
@@ -207,7 +230,11 @@ int main(int argc, char *argv[]) {
 
 	Stream *stream = 0;
 	KDTree *tree = 0;
+	KDTreeSoup *next_tree = 0;
 	int returncode = 0;
+	if(!profile.isEmpty())
+		Profiler::enable();
+
 	try {
 		quint64 max_memory = (1<<20)*(uint64_t)ram_buffer/4; //hack 4 is actually an estimate...
 
@@ -222,10 +249,19 @@ int main(int argc, char *argv[]) {
 
 		if (point_cloud) {
 			input = "pointcloud";
-			stream = new StreamCloud("cache_stream");
+			StreamCloud *cloud = new StreamCloud("cache_stream");
+			cloud->setCompressed(compress_temp);
+			stream = cloud;
+			if(fused)
+				cout << "Fused load is not supported for point clouds.\n";
+		}
+		else {
+			StreamSoup *soup = new StreamSoup("cache_stream");
+			soup->setCompact(compact);
+			soup->setFused(fused);
+			soup->setCompressed(compress_temp);
+			stream = soup;
 		}
-		else
-			stream = new StreamSoup("cache_stream");
 
 		if(!colormap.isNull()) {
 			stream->colormap = colormap.split(":");
@@ -236,33 +272,52 @@ int main(int argc, char *argv[]) {
 		}
 
 		stream->setVertexQuantization(vertex_quantization);
+		stream->n_threads = n_threads;
 		stream->setMaxMemory(max_memory);
-		if(center) {
-			vcg::Box3d box = stream->getBox(inputs);
-			vcg::Point3d m = box.min;
-			vcg::Point3d M = box.max;
-			cout << setprecision(12) << "Box: " << m[0] << " " << m[1] << " " << m[2] << "  --- " << M[0] << " " << M[1] << " " << M[2] << endl;
-			stream->origin = box.Center();
-		} else
-			stream->origin = origin;
-		if(!scalate.isEmpty())
-			stream->scale = scale;
-
-		vcg::Point3d &o = stream->origin;
-		if(o[0] != 0.0 || o[1] != 0.0 || o[2] != 0.0) {
-			int lastPoint = output.lastIndexOf(".");
-			QString ref = output.left(lastPoint) + ".js";
-			QFile file(ref);
-			if(!file.open(QFile::ReadWrite)) {
-				cerr << "Could not save reference file: " << qPrintable(ref) << endl;
-				return -1;
+		int resume_level = 0;
+		if(resume) {
+			if(checkpoint.isEmpty())
+				throw QString("resume needs a checkpoint directory (-x)");
+			resume_level = NexusBuilder::checkpointLevel(checkpoint);
+			if(!resume_level)
+				cout << "No checkpoint found in " << qPrintable(checkpoint) << ", starting from scratch\n";
+		}
+
+		if(resume_level) {
+			//origin, scale and attributes are restored too.
+			stream->restore(NexusBuilder::checkpointStream(checkpoint, resume_level));
+			stream->textures = NexusBuilder::checkpointTextures(checkpoint);
+		} else {
+			if(center) {
+				vcg::Box3d box = stream->getBox(inputs);
+				vcg::Point3d m = box.min;
+				vcg::Point3d M = box.max;
+				cout << setprecision(12) << "Box: " << m[0] << " " << m[1] << " " << m[2] << "  --- " << M[0] << " " << M[1] << " " << M[2] << endl;
+				stream->origin = box.Center();
+			} else
+				stream->origin = origin;
+			if(!scalate.isEmpty())
+				stream->scale = scale;
+
+			vcg::Point3d &o = stream->origin;
+			if(o[0] != 0.0 || o[1] != 0.0 || o[2] != 0.0) {
+				int lastPoint = output.lastIndexOf(".");
+				QString ref = output.left(lastPoint) + ".js";
+				QFile file(ref);
+				if(!file.open(QFile::ReadWrite)) {
+					cerr << "Could not save reference file: " << qPrintable(ref) << endl;
+					return -1;
+				}
+				QTextStream stream(&file);
+				stream.setRealNumberPrecision(12);
+				stream << "{ \"origin\": [" << o[0] << ", " << o[1] << ", " << o[2] << "] }\n";
 			}
-			QTextStream stream(&file);
-			stream.setRealNumberPrecision(12);
-			stream << "{ \"origin\": [" << o[0] << ", " << o[1] << ", " << o[2] << "] }\n";
+			//TODO: actually the stream will store textures or normals or colors even if not needed
+			ProfileScope scope("load");
+			stream->load(inputs, mtl);
+			for(QString &input: inputs)
+				scope.addBytes(QFileInfo(input).size());
 		}
-		//TODO: actually the stream will store textures or normals or colors even if not needed
-		stream->load(inputs, mtl);
 
 /*			VcgLoader<Mesh> *loader = new VcgLoader<Mesh>;
 			loader->load(inputs[0], has_colors, has_normals, has_textures);
@@ -307,6 +362,7 @@ int main(int argc, char *argv[]) {
 		builder.n_threads = n_threads;
 		builder.setScaling(scaling);
 		builder.useNodeTex = !useOrigTex;
+		builder.flatSimplify = (decimation == "flat");
 		builder.createPowTwoTex = create_pow_two_tex;
 		if(deepzoom)
 			builder.header.signature.flags |= nx::Signature::Flags::DEEPZOOM;
@@ -316,28 +372,83 @@ int main(int argc, char *argv[]) {
 			cerr << "Exiting" << endl;
 			return 1;
 		}
+		if(resume_level) //after level 0 the stream has no textures.
+			stream->textures.clear();
+
+		if(pipelined && !checkpoint.isEmpty()) {
+			cout << "Checkpoints are not supported with pipelined construction.\n";
+			pipelined = false;
+		}
+		builder.checkpoint = checkpoint;
+		builder.resume = resume_level > 0;
 
 
+		if(point_cloud && pipelined) {
+			cout << "Pipelined construction is not supported for point clouds.\n";
+			pipelined = false;
+		}
+
+		quint64 tree_memory = (1<<20)*(uint64_t)ram_buffer/2;
+		if(pipelined) { //two trees are in use at the same time.
+			tree_memory /= 2;
+			next_tree = new KDTreeSoup("cache_tree", adaptive.toFloat());
+		}
+
 		if(point_cloud)
 			tree = new KDTreeCloud("cache_tree", adaptive.toFloat());
 		else
 			tree = new KDTreeSoup("cache_tree", adaptive.toFloat());
 
-		tree->setMaxMemory((1<<20)*(uint64_t)ram_buffer/2);
-		KDTreeSoup *treesoup = dynamic_cast<KDTreeSoup *>(tree);
-		if(treesoup) {
-			treesoup->setMaxWeight(node_size);
-			treesoup->texelWeight = texel_weight;
-			treesoup->setTrianglesPerBlock(node_size);
-		}
+		for(KDTree *t: std::vector<KDTree *>{ tree, next_tree }) {
+			if(!t) continue;
+			t->setMaxMemory(tree_memory);
+			t->n_threads = n_threads;
+			KDTreeSoup *treesoup = dynamic_cast<KDTreeSoup *>(t);
+			if(treesoup) {
+				treesoup->setCompressed(compress_temp);
+				treesoup->setMaxWeight(node_size);
+				treesoup->texelWeight = texel_weight;
+				treesoup->setTrianglesPerBlock(node_size);
+			}
 
-		KDTreeCloud *treecloud = dynamic_cast<KDTreeCloud *>(tree);
-		if(treecloud)
-			treecloud->setTrianglesPerBlock(node_size);
+			KDTreeCloud *treecloud = dynamic_cast<KDTreeCloud *>(t);
+			if(treecloud) {
+				treecloud->setCompressed(compress_temp);
+				treecloud->setTrianglesPerBlock(node_size);
+			}
+		}
 
-		builder.create(tree, stream,  top_node_size);
+		if(pipelined)
+			builder.createPipelined(dynamic_cast<KDTreeSoup *>(tree), next_tree, dynamic_cast<StreamSoup *>(stream), top_node_size);
+		else
+			builder.create(tree, stream,  top_node_size);
 		builder.save(output);
 
+		const VirtualMemoryStats &cs = builder.chunks.stats();
+		quint64 minor_faults, major_faults;
+		VirtualMemory::pageFaults(minor_faults, major_faults);
+		cout << "Chunk cache: " << cs.hits << " hits, " << cs.maps << " maps, " << cs.unmaps << " unmaps, "
+			 << cs.prefetches << " prefetches\n";
+		cout << "Page faults: " << minor_faults << " minor, " << major_faults << " major\n";
+		if(compress_temp) {
+			std::vector<const VirtualMemoryStats *> temp;
+			for(KDTree *t: std::vector<KDTree *>{ tree, next_tree }) {
+				if(dynamic_cast<KDTreeSoup *>(t)) temp.push_back(&dynamic_cast<KDTreeSoup *>(t)->stats());
+				if(dynamic_cast<KDTreeCloud *>(t)) temp.push_back(&dynamic_cast<KDTreeCloud *>(t)->stats());
+			}
+			if(dynamic_cast<StreamSoup *>(stream)) temp.push_back(&dynamic_cast<StreamSoup *>(stream)->stats());
+			if(dynamic_cast<StreamCloud *>(stream)) temp.push_back(&dynamic_cast<StreamCloud *>(stream)->stats());
+			quint64 raw = 0, stored = 0;
+			for(const VirtualMemoryStats *ts: temp) {
+				raw += ts->raw_bytes;
+				stored += ts->stored_bytes;
+			}
+			cout << "Temporary blocks: " << (raw>>20) << "MB written as " << (stored>>20) << "MB\n";
+		}
+
+		if(!profile.isEmpty())
+			Profiler::save(profile + ".json", profile + ".trace.json");
+
 	} catch(QString error) {
 		cerr << "Fatal error: " << qPrintable(error) << endl;
 		returncode = 1;
@@ -348,6 +459,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	if(tree)   delete tree;
+	if(next_tree) delete next_tree;
 	if(stream) delete stream;
 
 	return returncode;
@@ -21,6 +21,7 @@ for more details.
 #include <QDebug>
 
 #include "mesh.h"
+#include "flatsimplifier.h"
 #include <vcg/space/index/kdtree/kdtree.h>
 #include <iostream>
 
@@ -174,12 +175,13 @@ void Mesh::getVertices(Splat *vertices, quint32 node) {
 	}
 }
 
-float Mesh::simplify(quint16 target_faces, Simplification method) {
+float Mesh::simplify(quint16 target_faces, Simplification method, int n_threads) {
 
 	float error = -1;
 	switch(method) {
 	case RANDOM: error = randomSimplify(target_faces); break;
 	case QUADRICS: error = quadricSimplify(target_faces); break;
+	case FLAT_QUADRICS: error = flatSimplify(target_faces, n_threads); break;
 	default: throw QString("unknown simplification method");
 	}
 
@@ -433,6 +435,48 @@ float Mesh::quadricSimplify(quint16 target) {
 	return edgeLengthError();
 }
 
+float Mesh::flatSimplify(quint16 target, int n_threads) {
+	FlatSimplifier simplifier;
+	simplifier.positions.resize(vert.size());
+	simplifier.locked.resize(vert.size());
+	for(uint i = 0; i < vert.size(); i++) {
+		simplifier.positions[i] = vert[i].cP();
+		simplifier.locked[i] = !vert[i].IsW();
+	}
+	simplifier.indices.reserve(fn*3);
+	for(uint i = 0; i < face.size(); i++) {
+		AFace &f = face[i];
+		if(f.IsD()) continue;
+		for(int k = 0; k < 3; k++)
+			simplifier.indices.push_back(f.V(k) - &*vert.begin());
+	}
+
+	simplifier.simplify(target, n_threads);
+
+	//node is assigned in getTriangles, faces can be reused in any order
+	quint32 n = simplifier.nTriangles();
+	for(quint32 i = 0; i < n; i++) {
+		AFace &f = face[i];
+		f.ClearD();
+		for(int k = 0; k < 3; k++)
+			f.V(k) = &vert[simplifier.indices[i*3 + k]];
+	}
+	for(uint i = n; i < face.size(); i++)
+		face[i].SetD();
+	fn = n;
+
+	//collapsed vertices are deleted as in quadricSimplify
+	std::vector<char> used(vert.size(), 0);
+	for(quint32 v: simplifier.indices)
+		used[v] = 1;
+	vn = 0;
+	for(uint i = 0; i < vert.size(); i++) {
+		if(used[i]) vn++;
+		else vert[i].SetD();
+	}
+	return edgeLengthError();
+}
+
 float Mesh::edgeLengthError() {
 	if(!face.size()) return 0;
 	float error = 0;
@@ -105,7 +105,7 @@ public:
 
 class Mesh: public vcg::tri::TriMesh<std::vector<AVertex>, std::vector<AFace> > {
 public:
-	enum Simplification { QUADRICS, EDGE, CLUSTER, RANDOM };
+	enum Simplification { QUADRICS, EDGE, CLUSTER, RANDOM, FLAT_QUADRICS };
 	void load(Soup &soup);
 	void load(Cloud &soup);
 	//void lock(std::vector<bool> &locked);
@@ -114,7 +114,7 @@ public:
 	void getTriangles(Triangle *triangles, quint32 node);
 	void getVertices(Splat *vertices, quint32 node);
 
-	float simplify(quint16 target_faces, Simplification method);
+	float simplify(quint16 target_faces, Simplification method, int n_threads = 1); //threads used only by FLAT_QUADRICS
 	std::vector<AVertex> simplifyCloud(quint16 target_vertices); //return removed vertices
 	float averageDistance();
 
@@ -130,6 +130,7 @@ public:
 	float randomSimplify(quint16 target_faces);
 	void quadricInit();
 	float quadricSimplify(quint16 target_faces);
+	float flatSimplify(quint16 target_faces, int n_threads = 1); //no quadricInit needed, respects lockVertices
 
 	float edgeLengthError();
 
@@ -18,6 +18,8 @@ for more details.
 #include "meshloader.h"
 #include <QFileInfo>
 
+#include <math.h>
+
 void MeshLoader::quantize(float &value) {
 	if(!quantization) return;
 	value = quantization*(int)(value/quantization);
@@ -33,3 +35,58 @@ void MeshLoader::resolveTextureFilepath(const QString &modelFilepath, QString &t
 
   textureFilepath = path + "/" + textureFilepath;
 }
+
+//fast number parser, no hex, inf or nan. Digits beyond the 18th only shift the exponent.
+bool MeshLoader::parseNumber(const char *&p, const char *end, double &value) {
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+									 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+
+	bool negative = false;
+	if(p < end && (*p == '-' || *p == '+'))
+		negative = (*p++ == '-');
+
+	quint64 mantissa = 0;
+	int exponent = 0;
+	bool digits = false;
+	for(; p < end && *p >= '0' && *p <= '9'; p++) {
+		if(mantissa < 100000000000000000ull)
+			mantissa = mantissa*10 + (*p - '0');
+		else
+			exponent++;
+		digits = true;
+	}
+	if(p < end && *p == '.') {
+		for(p++; p < end && *p >= '0' && *p <= '9'; p++) {
+			if(mantissa < 100000000000000000ull) {
+				mantissa = mantissa*10 + (*p - '0');
+				exponent--;
+			}
+			digits = true;
+		}
+	}
+	if(!digits)
+		return false;
+
+	if(p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		bool negative_exp = false;
+		if(p < end && (*p == '-' || *p == '+'))
+			negative_exp = (*p++ == '-');
+		int e = 0;
+		for(; p < end && *p >= '0' && *p <= '9'; p++)
+			if(e < 10000)
+				e = e*10 + (*p - '0');
+		exponent += negative_exp ? -e : e;
+	}
+
+	value = (double)mantissa;
+	if(exponent < 0)
+		value /= (-exponent <= 22) ? powers[-exponent] : pow(10.0, -exponent);
+	else if(exponent > 0)
+		value *= (exponent <= 22) ? powers[exponent] : pow(10.0, exponent);
+	if(negative)
+		value = -value;
+	return true;
+}
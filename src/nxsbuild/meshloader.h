@@ -51,6 +51,7 @@ public:
 	
 	std::vector<LoadTexture> texture_filenames;
 	int texOffset; //when returning triangles add texOffset to refer to the correct texture in stream.
+	int n_threads = 1; //loaders able to decode in parallel use this many threads.
 
 	
 protected:
@@ -60,6 +61,8 @@ protected:
 	float quantization;
 
 	void quantize(float &value);
+	//parses a number skipping leading blanks and advancing p, returns false if no number is found.
+	static bool parseNumber(const char *&p, const char *end, double &value);
 	void sanitizeTextureFilepath (QString &textureFilepath);
 	void resolveTextureFilepath (const QString &modelFilepath, QString &textureFilepath);
 };
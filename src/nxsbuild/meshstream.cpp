@@ -16,6 +16,7 @@ GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
 for more details.
 */
 #include <QDebug>
+#include <QDir>
 #include <QFileInfo>
 
 #include "meshstream.h"
@@ -27,16 +28,19 @@ for more details.
 #include "vcgloadermesh.h"
 #include "vcgloader.h"
 #include "tsloader.h"
+#include "packedsoup.h"
+#include "parallel.h"
 
 
 #include <iostream>
 
 using namespace std;
 
-Stream::Stream():
+Stream::Stream(QString _prefix):
 	has_colors(false),
 	has_normals(false),
 	has_textures(false),
+	prefix(_prefix),
 	vertex_quantization(0),
 	current_triangle(0),
 	current_block(0) {
@@ -88,6 +92,7 @@ vcg::Box3d Stream::getBox(QStringList paths) {
 	foreach(QString file, paths) {
 		qDebug() << "Computing box for " << qPrintable(file);
 		MeshLoader *loader = getLoader(file, QString());
+		loader->n_threads = n_threads;
 		loader->setMaxMemory(512*(1<<20)); //read only once... does'nt really matter.
 		while(true) {
 			int count = loader->getVertices(length, vertices);
@@ -102,8 +107,11 @@ vcg::Box3d Stream::getBox(QStringList paths) {
 
 void Stream::load(MeshLoader *loader) {
 	loader->setVertexQuantization(vertex_quantization);
+	loader->n_threads = n_threads;
 	loader->origin = origin;
 	loader->scale = scale;
+	loader->setMaxMemory(maxMemory());
+	loader->texOffset = textures.size();
 	loadMesh(loader);
 	has_colors &= loader->hasColors();
 	has_normals &= loader->hasNormals();
@@ -121,17 +129,206 @@ void Stream::load(QStringList paths, QString material) {
 	has_colors = true;
 	has_normals = true;
 	has_textures = true;
+	input_paths = paths;
+	input_material = material;
+	//vcg importers load the whole mesh when opened (twice, see loadConcurrent), and are not known to be thread safe.
+	bool streamed = true;
+	foreach(QString file, paths)
+		streamed &= file.endsWith(".ply") || file.endsWith(".tsp") || file.endsWith(".obj") || file.endsWith(".stl") || file.endsWith(".ts");
+	if(n_threads > 1 && paths.size() > 1 && streamed && !orderedLoad()) {
+		loadConcurrent(paths, material);
+	} else {
+		foreach(QString file, paths) {
+			qDebug() << "Reading" << qPrintable(file);
+			MeshLoader *loader = getLoader(file, material);
+			load(loader);
+			//box.Add(loader->box); //this lineB AFTER the mesh is streamed
+			delete loader;
+		}
+	}
+	current_triangle = 0;
+	flush();
+}
+
+/* files are read by a pool of loaders, each one pushing its batches under m_load.
+   Textures and texOffset must not depend on which file finishes first: the loaders are opened once before,
+   in order, to collect the textures (it only parses headers and materials), the flags are combined at the end. */
+void Stream::loadConcurrent(QStringList paths, QString material) {
+	std::vector<int> tex_offsets;
 	foreach(QString file, paths) {
-		qDebug() << "Reading" << qPrintable(file);
 		MeshLoader *loader = getLoader(file, material);
-		load(loader);
-		//box.Add(loader->box); //this lineB AFTER the mesh is streamed
+		tex_offsets.push_back(textures.size());
+		has_textures &= loader->hasTextures();
+		if(has_textures) {
+			for(auto tex: loader->texture_filenames)
+				textures.push_back(tex);
+		}
 		delete loader;
 	}
-	current_triangle = 0;
-	flush();
+
+	parked.assign(paths.size(), nullptr);
+	parked_done.assign(paths.size(), 0);
+	load_turn = 0;
+	load_failed = false;
+
+	int workers = std::min<int>(n_threads, paths.size());
+	std::vector<char> colors(paths.size()), normals(paths.size()), texcoords(paths.size());
+	QAtomicInt next(0);
+	quint32 batch = batch_size;
+	batch_size = std::max<quint32>(batch/workers, 1<<16); //the buffers of loadMesh are per worker now
+	//parked data is bounded: a worker does not start a file more than this many files past the turn.
+	int max_ahead = workers;
+	parallelFor(0, workers, workers, [&](qint64, qint64) {
+		while(true) {
+			int k = next.fetchAndAddOrdered(1);
+			if(k >= paths.size())
+				break;
+			{
+				QMutexLocker locker(&m_load);
+				while(!load_failed && k > load_turn + max_ahead)
+					load_room.wait(&m_load);
+				if(load_failed)
+					break;
+			}
+			qDebug() << "Reading" << qPrintable(paths[k]);
+			MeshLoader *loader = getLoader(paths[k], material);
+			loader->setVertexQuantization(vertex_quantization);
+			loader->n_threads = std::max(1, n_threads/workers);
+			loader->origin = origin;
+			loader->scale = scale;
+			loader->setMaxMemory(maxMemory()/workers);
+			loader->texOffset = tex_offsets[k];
+			try {
+				loadMesh(loader, k);
+			} catch(...) {
+				delete loader;
+				QMutexLocker locker(&m_load);
+				load_failed = true;
+				load_room.wakeAll();
+				throw;
+			}
+			colors[k] = loader->hasColors();
+			normals[k] = loader->hasNormals();
+			texcoords[k] = loader->hasTextures();
+			delete loader;
+		}
+	}, 1);
+	batch_size = batch;
+	assert(load_turn == paths.size());
+	parked.clear();
+
+	for(int k = 0; k < paths.size(); k++) {
+		has_colors &= (bool)colors[k];
+		has_normals &= (bool)normals[k];
+		has_textures &= (bool)texcoords[k];
+	}
+}
+
+/* the stream content follows the file order whatever file is read first: the file in turn is pushed as it is read,
+   the others are parked and pushed when their turn comes (by whoever completes the previous file). */
+void Stream::pushLoaded(int file, char *elements, quint32 n) {
+	if(file < 0 || file == load_turn) {
+		if(file >= 0)
+			unpark(file);
+		pushElements(elements, n);
+		return;
+	}
+	QTemporaryFile *&buffer = parked[file];
+	if(!buffer) {
+		buffer = new QTemporaryFile(QDir::tempPath() + "/" + prefix + "_parked"); //next to the stream blocks
+		if(!buffer->open())
+			throw QString("unable to open temporary file: " + buffer->fileName());
+	}
+	qint64 size = qint64(n)*elementSize();
+	if(buffer->write(elements, size) != size)
+		throw QString("failed writing temporary file %1: %2").arg(buffer->fileName()).arg(buffer->errorString());
+}
+
+void Stream::finishLoaded(int file) {
+	parked_done[file] = 1;
+	while(load_turn < (int)parked.size()) {
+		unpark(load_turn);
+		if(!parked_done[load_turn])
+			break;
+		load_turn++;
+		load_room.wakeAll();
+	}
+}
+
+void Stream::unpark(int file) {
+	QTemporaryFile *buffer = parked[file];
+	if(!buffer)
+		return;
+	buffer->seek(0);
+	std::vector<char> elements(qint64(batch_size)*elementSize());
+	while(true) {
+		qint64 size = buffer->read(elements.data(), elements.size());
+		if(size < 0)
+			throw QString("failed reading temporary file %1: %2").arg(buffer->fileName()).arg(buffer->errorString());
+		if(size == 0)
+			break;
+		assert(size % elementSize() == 0);
+		pushElements(elements.data(), size/elementSize());
+	}
+	delete buffer;
+	parked[file] = nullptr;
+}
+
+void Stream::save(QString filename) {
+	flush(); //compact streams encode their partial blocks here, before levels are written
+	QFile file(filename);
+	if(!file.open(QFile::WriteOnly | QFile::Truncate))
+		throw QString("could not create checkpoint %1: %2").arg(filename).arg(file.errorString());
+
+	writeValue(file, box);
+	writeValue(file, has_colors);
+	writeValue(file, has_normals);
+	writeValue(file, has_textures);
+	writeValue(file, origin);
+	writeValue(file, scale);
+	writeValue(file, current_triangle);
+	quint64 n = textures.size();
+	writeValue(file, n);
+	for(LoadTexture &tex: textures) {
+		writeString(file, tex.filename);
+		writeValue(file, tex.width);
+		writeValue(file, tex.height);
+	}
+	n = levels.size();
+	writeValue(file, n);
+	for(auto &level: levels)
+		writeVector(file, level);
+	saveBlocks(file);
+	syncFile(file);
 }
 
+void Stream::restore(QString filename) {
+	QFile file(filename);
+	if(!file.open(QFile::ReadOnly))
+		throw QString("could not open checkpoint %1: %2").arg(filename).arg(file.errorString());
+
+	clear();
+	readValue(file, box);
+	readValue(file, has_colors);
+	readValue(file, has_normals);
+	readValue(file, has_textures);
+	readValue(file, origin);
+	readValue(file, scale);
+	readValue(file, current_triangle);
+	quint64 n;
+	readValue(file, n);
+	textures.resize(n);
+	for(LoadTexture &tex: textures) {
+		readString(file, tex.filename);
+		readValue(file, tex.width);
+		readValue(file, tex.height);
+	}
+	readValue(file, n);
+	levels.resize(n);
+	for(auto &level: levels)
+		readVector(file, level);
+	restoreBlocks(file);
+}
 
 void Stream::clear() {
 	clearVirtual();
@@ -167,75 +364,350 @@ void Stream::computeOrder() {
 //SOUP
 
 StreamSoup::StreamSoup(QString prefix):
-	VirtualTriangleSoup(prefix) {
+	Stream(prefix), VirtualTriangleSoup(prefix), packed(prefix + "_packed") {
 }
 
-void StreamSoup::loadMesh(MeshLoader *loader) {
-	loader->setMaxMemory(maxMemory());
-	loader->texOffset = textures.size();
+void StreamSoup::loadMesh(MeshLoader *loader, int file) {
+	if(fused) {
+		scanMesh(loader);
+		return;
+	}
 	//get 128Mb of data
-	quint32 length = (1<<20); //times 52 bytes.
+	quint32 length = batch_size; //times 80 bytes.
 	Triangle *triangles = new Triangle[length];
 	while(true) {
 		int count = loader->getTriangles(length, triangles);
 		if(count == 0) break;
-		for(int i = 0; i < count; i++) {
+		for(int i = 0; i < count; i++)
 			assert(triangles[i].node == 0);
-			pushTriangle(triangles[i]);
-		}
+		QMutexLocker locker(&m_load);
+		pushLoaded(file, (char *)triangles, count);
 	}
 	delete []triangles;
+	if(file >= 0) {
+		QMutexLocker locker(&m_load);
+		finishLoaded(file);
+	}
 }
 
 void StreamSoup::pushTriangle(Triangle &triangle) {
+	pushTriangles(&triangle, 1);
+}
 
-	//ignore degenerate faces
-	vcg::Point3f v[3];
-	for(int k = 0; k < 3; k++) {
-		v[k] = vcg::Point3f(triangle.vertices[k].v);
-		box.Add(v[k]);
+/* MOVED TO LOADER AND SIMPLIFIER: degenerate faces are not pushed here.
+   Triangle i goes to level getLevel(i): the current block of each level stays pinned for the whole run
+   and is filled through the occupancy directly (a Soup would point into occupancy, which moves when a block is added). */
+void StreamSoup::pushTriangles(Triangle *triangles, quint32 n) {
+	if(compact) {
+		pushPacked(triangles, n);
+		return;
 	}
+	std::vector<qint64> blocks;      //current block for each level
+	std::vector<Triangle *> data;
+
+	for(quint32 i = 0; i < n; i++) {
+		Triangle &triangle = triangles[i];
+		for(int k = 0; k < 3; k++)
+			box.Add(vcg::Point3f(triangle.vertices[k].v));
+
+		quint64 level = getLevel(current_triangle);
+		assert(levels.size() >= level);
+		if(blocks.size() <= level) {
+			blocks.resize(level + 1, -1);
+			data.resize(level + 1, NULL);
+		}
 
-	/* MOVED TO LOADER AND SIMPLIFIER */
-	/*ignore degenerate faces
-	if(v[0] == v[1] || v[1] == v[2] || v[2] == v[0])
-		return; */
-
-	quint64 level = getLevel(current_triangle);
-	assert(levels.size() >= level);
-
-	quint64 block = 0;
-	if(levels.size() == level) {  //need to add a level
-		levels.push_back(std::vector<quint64>());
-		block = addBlock(level);
+		qint64 &block = blocks[level];
+		if(block < 0 || isBlockFull(block)) {
+			if(block >= 0)
+				unpinBlock(block);
+
+			bool added = true;
+			if(levels.size() == level) {  //need to add a level
+				levels.push_back(std::vector<quint64>());
+				block = addBlock(level);
+			} else {
+				block = levels[level].back();
+				added = isBlockFull(block);
+				if(added)
+					block = addBlock(level);
+			}
+			data[level] = (Triangle *)pinBlock(block);
+#ifdef WIN32
+			//addBlock flushes: the blocks of the other levels got unmapped and unpinned
+			if(added)
+				for(quint64 l = 0; l < blocks.size(); l++)
+					if(l != level && blocks[l] >= 0)
+						data[l] = (Triangle *)pinBlock(blocks[l]);
+#endif
+		}
+		data[level][occupancy[block]++] = triangle;
 
-	} else {
-		block = levels[level].back();
-		if(isBlockFull(block))
-			block = addBlock(level);
+		current_triangle++;
 	}
-
-	Soup soup = get(block);
-	soup.push_back(triangle);
-
-	current_triangle++;
+	for(qint64 block: blocks)
+		if(block >= 0)
+			unpinBlock(block);
 }
 
 Soup StreamSoup::streamTriangles() {
+	if(scanned)
+		return streamFused();
+	if(compact)
+		return streamPacked();
 	if(current_block == 0)
 		computeOrder();
 	if(current_block == order.size())
 		return Soup(NULL, NULL, 0);
 
-	flush(); //save memory
+	flush(); //save memory, also releases the pin on the previous block
 	quint64 block = order[current_block];
 	current_block++;
 
-	return get(block);
+	Soup soup = get(block);
+	if(current_block < order.size()) {
+		//read ahead the next block while this one is being processed.
+		pin(block);
+		prefetch(order[current_block]);
+	}
+	return soup;
 }
 
 void StreamSoup::clearVirtual() {
 	VirtualTriangleSoup::clear();
+	packed.clear();
+	open.clear();
+	packed_triangles = 0;
+
+	//only the first level is fused
+	fused = scanned = false;
+	scanned_triangles = 0;
+	stride = 1;
+	std::vector<Triangle>().swap(sample);
+	std::vector<quint64>().swap(sample_index);
+	tex_offsets.clear();
+	sample_pos = 0;
+	current_file = -1;
+	file_index = 0;
+	delete current_loader;
+	current_loader = nullptr;
+}
+
+/* first pass of a fused stream: box, attributes (see Stream::load) and a sample of the triangles.
+   The sample keeps the indices multiple of stride, stride doubles when it exceeds the memory budget. */
+void StreamSoup::scanMesh(MeshLoader *loader) {
+	scanned = true;
+	tex_offsets.push_back(loader->texOffset);
+	quint64 max_sample = std::max<quint64>(maxMemory()/(sizeof(Triangle) + sizeof(quint64)), triangles_per_block);
+
+	quint32 length = (1<<20);
+	Triangle *triangles = new Triangle[length];
+	while(true) {
+		int count = loader->getTriangles(length, triangles);
+		if(count == 0) break;
+		for(int i = 0; i < count; i++) {
+			Triangle &triangle = triangles[i];
+			for(int k = 0; k < 3; k++)
+				box.Add(vcg::Point3f(triangle.vertices[k].v));
+
+			quint64 index = scanned_triangles++;
+			if(index % stride)
+				continue;
+			sample.push_back(triangle);
+			sample_index.push_back(index);
+
+			if(sample.size() > max_sample) {
+				stride *= 2;
+				quint64 n = 0;
+				for(quint64 j = 0; j < sample.size(); j++) {
+					if(sample_index[j] % stride) continue;
+					sample[n] = sample[j];
+					sample_index[n] = sample_index[j];
+					n++;
+				}
+				sample.resize(n);
+				sample_index.resize(n);
+			}
+		}
+	}
+	delete []triangles;
+}
+
+/* the sample comes first in the order of the stream levels (coarse to fine), so that the adaptive
+   splits of the tree see a uniform distribution, then the rest of the files in their order. */
+Soup StreamSoup::streamFused() {
+	if(current_block == 0 && sample_pos == 0 && current_file < 0) {
+		std::vector<quint64> order(sample.size());
+		for(quint64 i = 0; i < order.size(); i++)
+			order[i] = i;
+		std::stable_sort(order.begin(), order.end(), [&](quint64 a, quint64 b) {
+			return getLevel(sample_index[a]/stride) > getLevel(sample_index[b]/stride);
+		});
+		std::vector<Triangle> sorted(sample.size());
+		for(quint64 i = 0; i < order.size(); i++)
+			sorted[i] = sample[order[i]];
+		sample.swap(sorted);
+		std::vector<quint64>().swap(sample_index);
+	}
+	current_block++;
+
+	if(sample_pos < sample.size()) {
+		decoded_size = std::min<quint64>(triangles_per_block, sample.size() - sample_pos);
+		Soup soup(sample.data() + sample_pos, &decoded_size, decoded_size);
+		sample_pos += decoded_size;
+		return soup;
+	}
+
+	decoded.resize(1<<20);
+	while(true) {
+		if(!current_loader) {
+			if(current_file + 1 >= input_paths.size()) {
+				std::vector<Triangle>().swap(sample);
+				return Soup(NULL, NULL, 0);
+			}
+			current_file++;
+			current_loader = getLoader(input_paths[current_file], input_material);
+			current_loader->setVertexQuantization(vertex_quantization);
+			current_loader->n_threads = n_threads;
+			current_loader->origin = origin;
+			current_loader->scale = scale;
+			current_loader->setMaxMemory(maxMemory());
+			current_loader->texOffset = tex_offsets[current_file];
+		}
+
+		int count = current_loader->getTriangles(decoded.size(), decoded.data());
+		if(count == 0) {
+			delete current_loader;
+			current_loader = nullptr;
+			continue;
+		}
+		//skip the sampled ones, already streamed
+		quint32 n = 0;
+		for(int i = 0; i < count; i++, file_index++)
+			if(file_index % stride)
+				decoded[n++] = decoded[i];
+		if(n == 0)
+			continue;
+		decoded_size = n;
+		return Soup(decoded.data(), &decoded_size, decoded_size);
+	}
+}
+
+quint64 StreamSoup::size() {
+	if(scanned)
+		return scanned_triangles;
+	if(!compact)
+		return VirtualTriangleSoup::size();
+	quint64 n = packed_triangles;
+	for(auto &block: open)
+		n += block.size();
+	return n;
+}
+
+void StreamSoup::flush() {
+	if(compact)
+		for(quint64 level = 0; level < open.size(); level++)
+			closeBlock(level);
+	packed.flush();
+	VirtualTriangleSoup::flush();
+}
+
+void StreamSoup::pushPacked(Triangle *triangles, quint32 n) {
+	for(quint32 i = 0; i < n; i++) {
+		Triangle &triangle = triangles[i];
+		for(int k = 0; k < 3; k++)
+			box.Add(vcg::Point3f(triangle.vertices[k].v));
+
+		quint64 level = getLevel(current_triangle);
+		assert(levels.size() >= level);
+		if(levels.size() == level)
+			levels.push_back(std::vector<quint64>());
+		if(open.size() <= level)
+			open.resize(level + 1);
+
+		std::vector<Triangle> &block = open[level];
+		block.push_back(triangle);
+		if(block.size() == triangles_per_block)
+			closeBlock(level);
+
+		current_triangle++;
+	}
+}
+
+//encode the block being filled in level, the next triangle of the level starts a new one.
+void StreamSoup::closeBlock(quint64 level) {
+	std::vector<Triangle> &block = open[level];
+	if(!block.size())
+		return;
+
+	static thread_local std::vector<uchar> buffer;
+	quint64 size = PackedSoup::encode(block.data(), block.size(), buffer);
+	quint64 chunk = packed.addChunk(size);
+	memcpy(packed.getChunk(chunk), buffer.data(), size);
+	levels[level].push_back(chunk);
+	packed_triangles += block.size();
+
+	std::vector<Triangle>().swap(block);
+}
+
+Soup StreamSoup::streamPacked() {
+	if(current_block == 0) {
+		flush(); //encode the partial blocks
+		computeOrder();
+	}
+	if(current_block == order.size())
+		return Soup(NULL, NULL, 0);
+
+	quint64 block = order[current_block];
+	current_block++;
+
+	decoded_size = PackedSoup::decode(packed.getChunk(block), decoded);
+	packed.dropChunk(block); //read once
+	if(current_block < order.size())
+		packed.prefetchChunk(order[current_block]);
+	return Soup(decoded.data(), &decoded_size, decoded_size);
+}
+
+/* compact streams save the packed chunks, a 0 marks them (triangles_per_block is never 0) */
+void StreamSoup::saveBlocks(QFile &file) {
+	if(!compact) {
+		VirtualTriangleSoup::save(file);
+		return;
+	}
+	quint64 marker = 0;
+	writeValue(file, marker);
+	writeValue(file, packed_triangles);
+	std::vector<quint64> sizes(packed.nBlocks());
+	for(quint64 i = 0; i < sizes.size(); i++)
+		sizes[i] = packed.chunkSize(i);
+	writeVector(file, sizes);
+	for(quint64 i = 0; i < sizes.size(); i++) {
+		if(file.write((char *)packed.getChunk(i), sizes[i]) != (qint64)sizes[i])
+			throw QString("failed writing checkpoint %1: %2").arg(file.fileName()).arg(file.errorString());
+		packed.dropChunk(i);
+	}
+}
+
+void StreamSoup::restoreBlocks(QFile &file) {
+	quint64 marker;
+	if(file.peek((char *)&marker, sizeof(marker)) != sizeof(marker))
+		throw QString("truncated checkpoint: %1").arg(file.fileName());
+	if((marker == 0) != compact)
+		throw QString("checkpoint %1 was saved %2 a compact stream (-Z)").arg(file.fileName()).arg(compact ? "without" : "with");
+	if(!compact) {
+		VirtualTriangleSoup::restore(file);
+		return;
+	}
+	readValue(file, marker);
+	readValue(file, packed_triangles);
+	std::vector<quint64> sizes;
+	readVector(file, sizes);
+	for(quint64 size: sizes) {
+		quint64 chunk = packed.addChunk(size);
+		if(file.read((char *)packed.getChunk(chunk), size) != (qint64)size)
+			throw QString("truncated checkpoint: %1").arg(file.fileName());
+		packed.dropChunk(chunk);
+	}
 }
 
 quint64 StreamSoup::addBlock(quint64 level) {
@@ -249,50 +721,80 @@ quint64 StreamSoup::addBlock(quint64 level) {
 //Cloud
 
 StreamCloud::StreamCloud(QString prefix):
-	VirtualVertexCloud(prefix) {
+	Stream(prefix), VirtualVertexCloud(prefix) {
 }
 
-void StreamCloud::loadMesh(MeshLoader *loader) {
-	loader->setMaxMemory(maxMemory());
+void StreamCloud::loadMesh(MeshLoader *loader, int file) {
 	//get 128Mb of data
-	quint32 length = (1<<20); //times 52 bytes.
+	quint32 length = batch_size; //times 52 bytes.
 	Splat *vertices = new Splat[length];
 	while(true) {
 		int count = loader->getVertices(length, vertices);
 
 		if(count == 0) break;
-		for(int i = 0; i < count; i++) {
+		for(int i = 0; i < count; i++)
 			assert(vertices[i].node == 0);
-			pushVertex(vertices[i]);
-		}
+		QMutexLocker locker(&m_load);
+		pushLoaded(file, (char *)vertices, count);
 	}
 	delete []vertices;
+	if(file >= 0) {
+		QMutexLocker locker(&m_load);
+		finishLoaded(file);
+	}
 }
 
 void StreamCloud::pushVertex(Splat &vertex) {
+	pushVertices(&vertex, 1);
+}
 
-	//ignore degenerate faces
-	vcg::Point3f p(vertex.v);
-	box.Add(p);
-
-	quint64 level = getLevel(current_triangle);
-	assert(levels.size() >= level);
+//see StreamSoup::pushTriangles
+void StreamCloud::pushVertices(Splat *vertices, quint32 n) {
+	std::vector<qint64> blocks;      //current block for each level
+	std::vector<Splat *> data;
 
-	quint64 block = 0;
-	if(levels.size() == level) {  //need to add a level
-		levels.push_back(std::vector<quint64>());
-		block = addBlock(level);
+	for(quint32 i = 0; i < n; i++) {
+		Splat &vertex = vertices[i];
+		box.Add(vcg::Point3f(vertex.v));
 
-	} else {
-		block = levels[level].back();
-		if(isBlockFull(block))
-			block = addBlock(level);
-	}
+		quint64 level = getLevel(current_triangle);
+		assert(levels.size() >= level);
+		if(blocks.size() <= level) {
+			blocks.resize(level + 1, -1);
+			data.resize(level + 1, NULL);
+		}
 
-	Cloud cloud = get(block);
-	cloud.push_back(vertex);
+		qint64 &block = blocks[level];
+		if(block < 0 || isBlockFull(block)) {
+			if(block >= 0)
+				unpinBlock(block);
+
+			bool added = true;
+			if(levels.size() == level) {  //need to add a level
+				levels.push_back(std::vector<quint64>());
+				block = addBlock(level);
+			} else {
+				block = levels[level].back();
+				added = isBlockFull(block);
+				if(added)
+					block = addBlock(level);
+			}
+			data[level] = (Splat *)pinBlock(block);
+#ifdef WIN32
+			//addBlock flushes: the blocks of the other levels got unmapped and unpinned
+			if(added)
+				for(quint64 l = 0; l < blocks.size(); l++)
+					if(l != level && blocks[l] >= 0)
+						data[l] = (Splat *)pinBlock(blocks[l]);
+#endif
+		}
+		data[level][occupancy[block]++] = vertex;
 
-	current_triangle++;
+		current_triangle++;
+	}
+	for(qint64 block: blocks)
+		if(block >= 0)
+			unpinBlock(block);
 }
 
 Cloud StreamCloud::streamVertices() {
@@ -302,11 +804,17 @@ Cloud StreamCloud::streamVertices() {
 	if(current_block == order.size())
 		return Cloud(NULL, NULL, 0);
 
-	flush(); //save memory
+	flush(); //save memory, also releases the pin on the previous block
 	quint64 block = order[current_block];
 	current_block++;
 
-	return get(block);
+	Cloud cloud = get(block);
+	if(current_block < order.size()) {
+		//read ahead the next block while this one is being processed.
+		pin(block);
+		prefetch(order[current_block]);
+	}
+	return cloud;
 }
 
 void StreamCloud::clearVirtual() {
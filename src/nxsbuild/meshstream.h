@@ -19,6 +19,8 @@ for more details.
 #define NX_MESHSTREAM_H
 
 #include <QStringList>
+#include <QMutex>
+#include <QWaitCondition>
 #include <vcg/space/box3.h>
 
 #include "trianglesoup.h"
@@ -41,14 +43,19 @@ public:
 	vcg::Point3d origin = vcg::Point3d(0, 0, 0);
 	vcg::Point3d scale = vcg::Point3d(1, 1, 1);
 	QStringList colormap; //used to convert a value into a color, .ts only
+	int n_threads = 1;    //passed to the loaders
 
-	Stream();
+	Stream(QString prefix);
 	virtual ~Stream() {}
 	void setVertexQuantization(double q);
 	vcg::Box3d getBox(QStringList paths);
 	void load(QStringList paths, QString material);
 	void load(MeshLoader *loader); //texture filenames must have the correct (relative or absolute) path!
 
+	//save and reload the whole stream (used for checkpoints)
+	void save(QString filename);
+	void restore(QString filename);
+
 
 	//return a block of triangles. The buffer is valid until next call to getTriangles. Return null when finished
 	void clear();
@@ -62,6 +69,17 @@ protected:
 	std::vector<std::vector<quint64> > levels; //for each level the list of blocks
 	std::vector<quint64> order;          //order of the block for streaming
 
+	QMutex m_load;              //loadMesh pushes under this lock, files may be loaded concurrently
+	//concurrent loads push the files in order: a file read before its turn is parked in a temporary file.
+	std::vector<QTemporaryFile *> parked;
+	std::vector<char> parked_done;
+	int load_turn = 0;          //file whose elements are pushed now
+	bool load_failed = false;   //a loader threw: nobody waits for its turn anymore
+	QWaitCondition load_room;   //signaled when the turn moves on
+	QString prefix;             //of the temporary files
+	quint32 batch_size = (1<<20); //elements read from a loader at a time
+	QStringList input_paths;    //as passed to load, fused streams read them again
+	QString input_material;
 	double vertex_quantization; //a power of 2.
 	quint64 current_triangle;   //used both for loading and streaming
 	quint64 current_block;
@@ -69,9 +87,20 @@ protected:
 	MeshLoader *getLoader(QString file, QString material);
 		
 	virtual void flush() = 0;
-	virtual void loadMesh(MeshLoader *loader) = 0;
+	//file is the index of the file in a concurrent load, -1 otherwise.
+	virtual void loadMesh(MeshLoader *loader, int file = -1) = 0;
+	virtual bool orderedLoad() { return false; } //true if the files must be read one after the other
+	virtual quint64 maxMemory() = 0;
+	void loadConcurrent(QStringList paths, QString material);
+	void pushLoaded(int file, char *elements, quint32 n); //under m_load
+	void finishLoaded(int file);                          //under m_load
+	void unpark(int file);
+	virtual quint32 elementSize() = 0;
+	virtual void pushElements(char *elements, quint32 n) = 0;
 	virtual void clearVirtual() = 0; //clear the virtualtrianglesoup or virtualtrianglebin
 	virtual quint64 addBlock(quint64 level) = 0; //return index of block added
+	virtual void saveBlocks(QFile &file) = 0;
+	virtual void restoreBlocks(QFile &file) = 0;
 
 	quint64 getLevel(qint64 index);
 	void computeOrder();
@@ -82,18 +111,54 @@ class StreamSoup: public Stream, public VirtualTriangleSoup {
 public:
 	StreamSoup(QString prefix);
 
+	//compact streams keep full blocks as PackedSoup: less disk traffic, some cpu to encode. Set before loading.
+	void setCompact(bool c) { compact = c; }
+	//fused streams do not copy the input: load only scans it (box, attributes and a sample),
+	//streamTriangles returns the sample and then reads the files again. Only for the first level.
+	void setFused(bool f) { fused = f; }
 	void pushTriangle(Triangle &triangle);
+	void pushTriangles(Triangle *triangles, quint32 n); //much faster than one at a time
 	//return a block of triangles. The buffer is valid until next call to getTriangles. Return null when finished
 	Soup streamTriangles();
-	quint64 size() { return VirtualTriangleSoup::size(); }
-	void setMaxMemory(quint64 m) { return VirtualTriangleSoup::setMaxMemory(m); }
+	quint64 size();
+	void setMaxMemory(quint64 m) { VirtualTriangleSoup::setMaxMemory(m); packed.setMaxMemory(m); }
 
-protected:    
-	void flush() { VirtualTriangleSoup::flush(); }
-	void loadMesh(MeshLoader *loader);
+protected:
+	bool compact = false;
+	VirtualChunks packed;                      //one chunk per block, levels refer to these
+	std::vector<std::vector<Triangle>> open;   //the block being filled in each level
+	quint64 packed_triangles = 0;
+	std::vector<Triangle> decoded;             //returned by streamTriangles
+	quint32 decoded_size = 0;
+
+	bool fused = false;
+	bool scanned = false;                      //fused and loaded: the stream is still in the files
+	quint64 scanned_triangles = 0;
+	quint64 stride = 1;                        //the sample holds the triangles whose index is a multiple of stride
+	std::vector<Triangle> sample;
+	std::vector<quint64> sample_index;
+	std::vector<int> tex_offsets;              //of each file
+	quint64 sample_pos = 0;
+	int current_file = -1;
+	MeshLoader *current_loader = nullptr;
+	quint64 file_index = 0;                    //index of the next triangle read from the files
+
+	void flush();
+	void loadMesh(MeshLoader *loader, int file = -1);
+	quint32 elementSize() { return sizeof(Triangle); }
+	void pushElements(char *elements, quint32 n) { pushTriangles((Triangle *)elements, n); }
 	void clearVirtual();
 	quint64 addBlock(quint64 level); //return index of block added
-
+	void saveBlocks(QFile &file);
+	void restoreBlocks(QFile &file);
+	bool orderedLoad() { return fused; } //the sample indices follow the file order
+	quint64 maxMemory() { return VirtualTriangleSoup::maxMemory(); }
+
+	void scanMesh(MeshLoader *loader);
+	Soup streamFused();
+	void pushPacked(Triangle *triangles, quint32 n);
+	void closeBlock(quint64 level);
+	Soup streamPacked();
 };
 
 
@@ -102,6 +167,7 @@ public:
 	StreamCloud(QString prefix);
 
 	void pushVertex(Splat &ertex);
+	void pushVertices(Splat *vertices, quint32 n);
 	//return a block of triangles. The buffer is valid until next call to getTriangles. Return null when finished
 	Cloud streamVertices();
 	quint64 size() { return VirtualVertexCloud::size(); }
@@ -109,9 +175,14 @@ public:
 
 protected:
 	void flush() { VirtualVertexCloud::flush(); }
-	void loadMesh(MeshLoader *loader);
+	void loadMesh(MeshLoader *loader, int file = -1);
+	quint32 elementSize() { return sizeof(Splat); }
+	void pushElements(char *elements, quint32 n) { pushVertices((Splat *)elements, n); }
 	void clearVirtual();
 	quint64 addBlock(quint64 level); //return index of block added
+	void saveBlocks(QFile &file) { VirtualVertexCloud::save(file); }
+	quint64 maxMemory() { return VirtualVertexCloud::maxMemory(); }
+	void restoreBlocks(QFile &file) { VirtualVertexCloud::restore(file); }
 
 };
 
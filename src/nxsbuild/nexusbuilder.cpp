@@ -23,7 +23,7 @@ for more details.
 #include <QImage>
 #include <QDir>
 #include <QImageWriter>
-#include "vertex_cache_optimizer.h"
+#include <QBuffer>
 
 #include "nexusbuilder.h"
 #include "kdtree.h"
@@ -31,11 +31,19 @@ for more details.
 #include "mesh.h"
 #include "tmesh.h"
 #include "../common/nexus.h"
+#include "checkpoint.h"
+#include "profiler.h"
+#include "nodeoptimizer.h"
+#include "parallel.h"
 
 #include <vcg/math/similarity2.h>
 #include <vcg/space/rect_packer.h>
 
 #include <iostream>
+#include <cstdio>
+#include <string.h>
+#include <functional>
+#include <unordered_map>
 using namespace std;
 
 using namespace nx;
@@ -121,12 +129,15 @@ NexusBuilder::NexusBuilder(Signature &signature): chunks("cache_chunks"), scalin
 }
 
 void NexusBuilder::initAtlas(std::vector<QImage>& textures) {
+	atlas.n_threads = n_threads;
 	if(textures.size()) {
 		atlas.addTextures(textures);
 	}
 }
 
 bool NexusBuilder::initAtlas(std::vector<LoadTexture> &textures) {
+	input_textures = textures;
+	atlas.n_threads = n_threads;
 	if(textures.size()) {
 		bool success = atlas.addTextures(textures);
 		if(!success)
@@ -136,18 +147,27 @@ bool NexusBuilder::initAtlas(std::vector<LoadTexture> &textures) {
 }
 
 void NexusBuilder::create(KDTree *tree, Stream *stream, uint top_node_size) {
-	Node sink;
-	sink.first_patch = 0;
-	nodes.push_back(sink);
-
 	int level = 0;
 	int last_top_level_size = 0;
+	if(resume)
+		level = restoreCheckpoint(last_top_level_size);
+
+	if(level == 0) {
+		Node sink;
+		sink.first_patch = 0;
+		nodes.push_back(sink);
+	}
+
 	do {
 		tree->clear();
 		if(level % 2) tree->setAxesDiagonal();
 		else tree->setAxesOrthogonal();
 
-		tree->load(stream);
+		{
+			quint64 element = dynamic_cast<StreamSoup *>(stream) ? sizeof(Triangle) : sizeof(Splat);
+			ProfileScope scope("partition", stream->size()*element);
+			tree->load(stream);
+		}
 		stream->clear();
 
 		createLevel(tree, stream, level);
@@ -159,12 +179,274 @@ void NexusBuilder::create(KDTree *tree, Stream *stream, uint top_node_size) {
 		}
 		last_top_level_size = stream->size();
 		skipSimplifyLevels--;
+
+		if(!checkpoint.isEmpty() && stream->size() > top_node_size)
+			saveCheckpoint(stream, level, last_top_level_size);
 	} while(stream->size() > top_node_size);
 
 	reverseDag();
 	saturate();
 }
 
+static const quint32 checkpoint_magic = 0x5043584e; //NXCP
+static const quint32 checkpoint_version = 1;
+
+QString NexusBuilder::checkpointStream(QString dir, int level) {
+	return QDir(dir).filePath(QString("stream_%1.bin").arg(level));
+}
+
+int NexusBuilder::checkpointLevel(QString dir) {
+	QFile file(QDir(dir).filePath("builder.bin"));
+	if(!file.open(QFile::ReadOnly))
+		return 0;
+	quint32 magic, version;
+	qint32 level;
+	if(file.read((char *)&magic, 4) != 4 || file.read((char *)&version, 4) != 4 || file.read((char *)&level, 4) != 4)
+		return 0;
+	if(magic != checkpoint_magic || version != checkpoint_version)
+		return 0;
+	return level;
+}
+
+std::vector<LoadTexture> NexusBuilder::checkpointTextures(QString dir) {
+	QFile file(QDir(dir).filePath("builder.bin"));
+	if(!file.open(QFile::ReadOnly))
+		throw QString("could not open checkpoint %1: %2").arg(file.fileName()).arg(file.errorString());
+	file.seek(12); //magic, version and level.
+	quint64 n;
+	readValue(file, n);
+	std::vector<LoadTexture> textures(n);
+	for(LoadTexture &tex: textures) {
+		readString(file, tex.filename);
+		readValue(file, tex.width);
+		readValue(file, tex.height);
+	}
+	return textures;
+}
+
+//copy length bytes from the current position of source to destination
+static void copyFile(QFile &source, QFile &destination, quint64 length) {
+	std::vector<char> buffer(1<<24);
+	while(length > 0) {
+		qint64 n = std::min<quint64>(length, buffer.size());
+		if(source.read(buffer.data(), n) != n)
+			throw QString("failed reading %1: %2").arg(source.fileName()).arg(source.errorString());
+		if(destination.write(buffer.data(), n) != n)
+			throw QString("failed writing %1: %2").arg(destination.fileName()).arg(destination.errorString());
+		length -= n;
+	}
+}
+
+/* a checkpoint is made of
+   stream_<level>.bin: the input of the next level
+   chunks.bin, nodetex.bin: append only, only the new chunks and node textures are written.
+   builder.bin: nodes, patches etc. and how much of chunks.bin and nodetex.bin is valid.
+   builder.bin is written last and renamed in place: until then the previous checkpoint is still valid. */
+
+void NexusBuilder::saveCheckpoint(Stream *stream, int level, int last_top_level_size) {
+	QDir dir(checkpoint);
+	if(!dir.mkpath("."))
+		throw QString("could not create checkpoint directory %1").arg(checkpoint);
+
+	stream->save(checkpointStream(checkpoint, level));
+
+	QFile chunkfile(dir.filePath("chunks.bin"));
+	if(!chunkfile.open(QFile::ReadWrite))
+		throw QString("could not open %1: %2").arg(chunkfile.fileName()).arg(chunkfile.errorString());
+	chunkfile.resize(checkpoint_chunk_bytes); //drop leftovers of an interrupted checkpoint
+	chunkfile.seek(checkpoint_chunk_bytes);
+	std::vector<quint64> chunk_sizes(chunks.nBlocks());
+	for(quint64 i = 0; i < chunks.nBlocks(); i++) {
+		chunk_sizes[i] = chunks.chunkSize(i);
+		if(i < checkpoint_chunks)
+			continue;
+		if(chunkfile.write((char *)chunks.getChunk(i), chunk_sizes[i]) != (qint64)chunk_sizes[i])
+			throw QString("failed writing %1: %2").arg(chunkfile.fileName()).arg(chunkfile.errorString());
+		chunks.dropChunk(i);
+		checkpoint_chunk_bytes += chunk_sizes[i];
+	}
+	checkpoint_chunks = chunks.nBlocks();
+	syncFile(chunkfile);
+
+	QFile texfile(dir.filePath("nodetex.bin"));
+	if(!texfile.open(QFile::ReadWrite))
+		throw QString("could not open %1: %2").arg(texfile.fileName()).arg(texfile.errorString());
+	texfile.resize(checkpoint_tex);
+	texfile.seek(checkpoint_tex);
+	quint64 tex_size = nodeTex.size();
+	nodeTex.seek(checkpoint_tex);
+	copyFile(nodeTex, texfile, tex_size - checkpoint_tex);
+	nodeTex.seek(tex_size);
+	checkpoint_tex = tex_size;
+	syncFile(texfile);
+
+	QString filename = dir.filePath("builder.bin");
+	QFile file(filename + ".tmp");
+	if(!file.open(QFile::WriteOnly | QFile::Truncate))
+		throw QString("could not create checkpoint %1: %2").arg(file.fileName()).arg(file.errorString());
+	writeValue(file, checkpoint_magic);
+	writeValue(file, checkpoint_version);
+	writeValue(file, (qint32)level);
+	quint64 n_textures = input_textures.size();
+	writeValue(file, n_textures);
+	for(LoadTexture &tex: input_textures) {
+		writeString(file, tex.filename);
+		writeValue(file, tex.width);
+		writeValue(file, tex.height);
+	}
+	writeValue(file, (qint32)last_top_level_size);
+	writeValue(file, (qint32)skipSimplifyLevels);
+	writeValue(file, input_pixels);
+	writeValue(file, output_pixels);
+	writeValue(file, header.signature);
+	writeValue(file, checkpoint_chunk_bytes);
+	writeValue(file, checkpoint_tex);
+	writeVector(file, chunk_sizes);
+	writeVector(file, nodes);
+	writeVector(file, patches);
+	writeVector(file, textures);
+	writeVector(file, boxes);
+	syncFile(file);
+	file.close();
+
+#ifdef WIN32
+	QFile::remove(filename);
+#endif
+	if(std::rename(QFile::encodeName(file.fileName()).constData(), QFile::encodeName(filename).constData()) != 0)
+		throw QString("could not commit checkpoint %1").arg(filename);
+
+	if(checkpoint_level != 0)
+		QFile::remove(checkpointStream(checkpoint, checkpoint_level));
+	checkpoint_level = level;
+	cout << "Checkpoint saved after level " << level << endl;
+}
+
+int NexusBuilder::restoreCheckpoint(int &last_top_level_size) {
+	int level = checkpointLevel(checkpoint);
+	if(level == 0)
+		return 0;
+
+	QDir dir(checkpoint);
+	QFile file(dir.filePath("builder.bin"));
+	if(!file.open(QFile::ReadOnly))
+		throw QString("could not open checkpoint %1: %2").arg(file.fileName()).arg(file.errorString());
+
+	quint32 magic, version;
+	qint32 l, top, skip;
+	readValue(file, magic);
+	readValue(file, version);
+	readValue(file, l);
+	quint64 n_textures;
+	readValue(file, n_textures);
+	for(quint64 i = 0; i < n_textures; i++) {
+		LoadTexture tex;
+		readString(file, tex.filename);
+		readValue(file, tex.width);
+		readValue(file, tex.height);
+	}
+	readValue(file, top);
+	readValue(file, skip);
+	readValue(file, input_pixels);
+	readValue(file, output_pixels);
+	Signature signature;
+	readValue(file, signature);
+	if(memcmp(&signature.vertex, &header.signature.vertex, sizeof(VertexElement)) != 0 ||
+			memcmp(&signature.face, &header.signature.face, sizeof(FaceElement)) != 0)
+		throw QString("checkpoint was created with different vertex or face attributes");
+	readValue(file, checkpoint_chunk_bytes);
+	readValue(file, checkpoint_tex);
+	std::vector<quint64> chunk_sizes;
+	readVector(file, chunk_sizes);
+	readVector(file, nodes);
+	readVector(file, patches);
+	readVector(file, textures);
+	readVector(file, boxes);
+	last_top_level_size = top;
+	skipSimplifyLevels = skip;
+
+	QFile chunkfile(dir.filePath("chunks.bin"));
+	if(!chunkfile.open(QFile::ReadOnly))
+		throw QString("could not open %1: %2").arg(chunkfile.fileName()).arg(chunkfile.errorString());
+	for(quint64 size: chunk_sizes) {
+		quint64 chunk = chunks.addChunk(size);
+		if(chunkfile.read((char *)chunks.getChunk(chunk), size) != (qint64)size)
+			throw QString("truncated checkpoint: %1").arg(chunkfile.fileName());
+		chunks.dropChunk(chunk);
+	}
+	checkpoint_chunks = chunk_sizes.size();
+
+	QFile texfile(dir.filePath("nodetex.bin"));
+	if(!texfile.open(QFile::ReadOnly))
+		throw QString("could not open %1: %2").arg(texfile.fileName()).arg(texfile.errorString());
+	nodeTex.resize(0);
+	nodeTex.seek(0);
+	copyFile(texfile, nodeTex, checkpoint_tex);
+
+	//texture pyramids are rebuilt from the original textures.
+	for(int i = 1; i < level; i++) {
+		atlas.buildLevel(i);
+		atlas.flush(i-1);
+	}
+
+	checkpoint_level = level;
+	cout << "Resuming from checkpoint after level " << level << endl;
+	return level;
+}
+
+void NexusBuilder::createPipelined(KDTreeSoup *tree, KDTreeSoup *next, StreamSoup *stream, uint top_node_size) {
+	Node sink;
+	sink.first_patch = 0;
+	nodes.push_back(sink);
+
+	//only the first level is read from the stream.
+	tree->clear();
+	tree->setAxesOrthogonal();
+	{
+		ProfileScope scope("partition", stream->size()*sizeof(Triangle));
+		tree->load(stream);
+	}
+	vcg::Box3f box = stream->box; //simplification does not move vertices outside of the input box (almost).
+	stream->clear();
+
+	int level = 0;
+	quint64 last_top_level_size = 0;
+	quint64 size = 0;
+	do {
+		next->clear();
+		if((level+1) % 2) next->setAxesDiagonal();
+		else next->setAxesOrthogonal();
+		next->textures = tree->textures;
+		next->startLoading(box);
+		{
+			ProfileScope scope("presplit");
+			presplit(tree, next);
+		}
+
+		next_tree = next;
+		createMeshLevel(tree, stream, level);
+		next_tree = nullptr;
+
+		{
+			ProfileScope scope("partition", next->size()*sizeof(Triangle));
+			next->finishLoading();
+		}
+		level++;
+
+		size = next->size();
+		if(skipSimplifyLevels <= 0 && last_top_level_size != 0 && size/(float)last_top_level_size > 0.9f) {
+			cout << "Stream: " << size << " Last top level size: " << last_top_level_size << endl;
+			cout << "Larger top level, most probably to high parametrization fragmentation.\n";
+			break;
+		}
+		last_top_level_size = size;
+		skipSimplifyLevels--;
+		std::swap(tree, next);
+	} while(size > top_node_size);
+
+	reverseDag();
+	saturate();
+}
+
 class UnionFind {
 public:
 	std::vector<int> parents;
@@ -420,7 +702,7 @@ QImage NexusBuilder::extractNodeTex(TMesh &mesh, int level, float &error, float
 	}
 
 	{
-		QMutexLocker locker(&m_atlas);
+		//the atlas is thread safe.
 		//	static int boxid = 0;
 		QPainter painter(&image);
 		//convert tex coordinates using mapping
@@ -485,86 +767,156 @@ QImage NexusBuilder::extractNodeTex(TMesh &mesh, int level, float &error, float
 	return image;
 }
 
-void NexusBuilder::createCloudLevel(KDTreeCloud *input, StreamCloud *output, int level) {
+//one block of a level, both for meshes and clouds.
+template <class Tree, class Output> class Worker: public QRunnable {
+public:
+	int level;
+	uint block;
+	Tree *input;
+	Output *output;
+	NexusBuilder &builder;
 
-	for(uint block = 0; block < input->nBlocks(); block++) {
-		Cloud cloud = input->get(block);
-		assert(cloud.size() < (1<<16));
-		if(cloud.size() == 0) continue;
+	Worker(NexusBuilder &_builder, Tree *in, Output *out, uint _block, int _level):
+		builder(_builder), input(in), output(out), block(_block), level(_level) {}
 
-		Mesh mesh;
-		mesh.load(cloud);
+protected:
+	//exceptions cannot leave a pool thread: the first one is rethrown when the level is done.
+	void run() {
+		if(builder.workerFailed())
+			return;
+		try {
+			builder.processBlock(input, output, block, level);
+		} catch(...) {
+			builder.setWorkerError(std::current_exception());
+		}
+	}
+};
 
-		int target_points = cloud.size()*scaling;
-		std::vector<AVertex> deleted = mesh.simplifyCloud(target_points);
 
-		//save node in nexus temporary structure
-		quint32 mesh_size = mesh.serializedSize(header.signature);
-		mesh_size = pad(mesh_size);
-		quint32 chunk = chunks.addChunk(mesh_size);
-		uchar *buffer = chunks.getChunk(chunk);
-		quint32 patch_offset = patches.size();
+//the level lasts as long as its largest block: start them first (nodes are numbered as they complete anyway).
+template <class Tree> static std::vector<uint> largestFirst(Tree *input) {
+	std::vector<uint> blocks;
+	for(uint block = 0; block < input->nBlocks(); block++)
+		if(input->blockUsed(block))
+			blocks.push_back(block);
+	std::stable_sort(blocks.begin(), blocks.end(), [&](uint a, uint b) { return input->blockUsed(a) > input->blockUsed(b); });
+	return blocks;
+}
 
-		std::vector<Patch> node_patches;
-		mesh.serialize(buffer, header.signature, node_patches);
+void NexusBuilder::createCloudLevel(KDTreeCloud *input, StreamCloud *output, int level) {
+	QThreadPool pool;
+	pool.setMaxThreadCount(n_threads);
 
-		//patches will be reverted later, but the local order is important because of triangle_offset
-		std::reverse(node_patches.begin(), node_patches.end());
-		patches.insert(patches.end(), node_patches.begin(), node_patches.end());
+	for(uint block: largestFirst(input)) {
+		Worker<KDTreeCloud, StreamCloud> *worker = new Worker<KDTreeCloud, StreamCloud>(*this, input, output, block, level);
+		pool.start(worker);
+	}
+	pool.waitForDone();
+	rethrowWorkerError();
+}
 
-		quint32 current_node = nodes.size();
-		nx::Node node = mesh.getNode();
-		node.offset = chunk; //temporaryle remember which chunk belongs to which node
-		node.error = mesh.averageDistance();
-		node.first_patch = patch_offset;
-		nodes.push_back(node);
-		boxes.push_back(NodeBox(input, block));
+bool NexusBuilder::workerFailed() {
+	ProfileLocker locker(&m_output, "m_output");
+	return (bool)worker_error;
+}
 
-		//we pick the deleted vertices from simplification and reprocess them.
+void NexusBuilder::setWorkerError(std::exception_ptr error) {
+	ProfileLocker locker(&m_output, "m_output");
+	if(!worker_error)
+		worker_error = error;
+	pending_room.wakeAll(); //pipelined workers waiting for their turn give up
+}
 
-		swap(mesh.vert, deleted);
-		mesh.vn = mesh.vert.size();
+void NexusBuilder::rethrowWorkerError() {
+	if(!worker_error)
+		return;
+	std::exception_ptr error = worker_error;
+	worker_error = nullptr;
+	std::rethrow_exception(error);
+}
 
-		Splat *vertices = new Splat[mesh.vn];
-		mesh.getVertices(vertices, current_node);
+void NexusBuilder::processBlock(KDTreeCloud *input, StreamCloud *output, uint block, int /*level*/) {
+	ProfileScope profile("processBlock");
 
-		for(int i = 0; i < mesh.vn; i++) {
-			Splat &s = vertices[i];
-			output->pushVertex(s);
-		}
+	Mesh mesh;
+	quint32 npoints;
+	{
+		Cloud cloud; //memory allocated by input, the handle keeps it mapped.
+		BlockHandle handle = input->acquire(block, cloud);
+		assert(cloud.size() < (1<<16));
+		if(cloud.size() == 0) return;
 
-		delete []vertices;
+		npoints = cloud.size();
+		profile.addBytes(npoints*sizeof(Splat));
+		mesh.load(cloud);
 	}
-}
 
+	std::vector<AVertex> deleted;
+	{
+		ProfileScope scope("simplify", npoints*sizeof(Splat));
+		int target_points = npoints*scaling;
+		deleted = mesh.simplifyCloud(target_points);
+	}
 
+	//save node in nexus temporary structure
+	quint32 mesh_size = mesh.serializedSize(header.signature);
+	mesh_size = pad(mesh_size);
+	uchar *buffer = new uchar[mesh_size];
 
-/*
-  Commented because the gain is negligible ( and the code is not correct either, there is
-  some problem in saving the trianglws... */
+	std::vector<Patch> node_patches;
+	{
+		ProfileScope scope("serialize", mesh_size);
+		mesh.serialize(buffer, header.signature, node_patches);
+	}
 
+	quint32 chunk;
+	{
+#ifdef WIN32
+		ProfileLocker locker(&m_chunks, "m_chunks"); //growing the file unmaps all the chunks on windows.
+#endif
+		chunk = chunks.addChunk(mesh_size);
+		BlockHandle handle = chunks.acquireChunk(chunk);
+		memcpy(handle.data, buffer, mesh_size);
+		handle.release(true);
+	}
+	delete []buffer;
 
-class Worker: public QRunnable {
-public:
-	int level;
-	uint block;
-	KDTreeSoup *input;
-	StreamSoup *output;
-	NexusBuilder &builder;
+	nx::Node node = mesh.getNode();
+	node.offset = chunk; //temporarily remember which chunk belongs to which node
+	node.error = mesh.averageDistance();
 
-	Worker(NexusBuilder &_builder, KDTreeSoup *in, StreamSoup *out, uint _block, int _level):
-		builder(_builder), input(in), output(out), block(_block), level(_level) {}
+	quint32 current_node;
+	{
+		ProfileLocker locker(&m_builder, "m_builder");
 
-protected:
-	void run() {
-		builder.processBlock(input, output, block, level);
+		//patches will be reverted later, but the local order is important because of triangle_offset
+		quint32 patch_offset = patches.size();
+		std::reverse(node_patches.begin(), node_patches.end());
+		patches.insert(patches.end(), node_patches.begin(), node_patches.end());
+
+		current_node = nodes.size();
+		node.first_patch = patch_offset;
+		nodes.push_back(node);
+		boxes.push_back(NodeBox(input, block));
 	}
-};
 
+	//we pick the deleted vertices from simplification and reprocess them.
+	swap(mesh.vert, deleted);
+	mesh.vn = mesh.vert.size();
+
+	Splat *vertices = new Splat[mesh.vn];
+	mesh.getVertices(vertices, current_node);
+
+	{
+		ProfileLocker locker(&m_output, "m_output");
+		output->pushVertices(vertices, mesh.vn);
+	}
+	delete []vertices;
+}
 
 void NexusBuilder::processBlock(KDTreeSoup *input, StreamSoup *output, uint block, int level) {
+	ProfileScope profile("processBlock");
 	TMesh mesh;
-	TMesh tmp; //this is needed saving a mesh with vertices on seams duplicated., and for node tex coordinates to be rearranged
 
 	Mesh mesh1;
 	quint32 mesh_size;
@@ -572,12 +924,13 @@ void NexusBuilder::processBlock(KDTreeSoup *input, StreamSoup *output, uint bloc
 
 	int ntriangles = 0;
 	{
-		QMutexLocker locker(&m_input);
-		Soup soup = input->get(block); //soup is memory allocated by input, lock is needed.
+		Soup soup; //soup is memory allocated by input, the handle keeps it mapped.
+		BlockHandle handle = input->acquire(block, soup);
 		assert(soup.size() < (1<<16));
 		if(soup.size() == 0) return;
 
 		ntriangles = soup.size();
+		profile.addBytes(ntriangles*sizeof(Triangle));
 		if(!hasTextures()) {
 			mesh1.load(soup);
 		} else {
@@ -595,22 +948,17 @@ void NexusBuilder::processBlock(KDTreeSoup *input, StreamSoup *output, uint bloc
 	} else {
 
 		input->lock(mesh, block);
-		//we need to replicate vertices where textured seams occours
-
-		vcg::tri::Append<TMesh,TMesh>::MeshCopy(tmp,mesh);
-		for(int i = 0; i < tmp.face.size(); i++) {
-			tmp.face[i].node = mesh.face[i].node;
-			tmp.face[i].tex = mesh.face[i].tex;
-		}
-		tmp.splitSeams(header.signature);
-		if(tmp.vert.size() > 60000) {
+		//we need to replicate vertices where textured seams occours,
+		//they are merged back before simplification (node tex coordinates are rearranged only on vertices).
+		mesh.splitSeams(header.signature);
+		if(mesh.vert.size() > 60000) {
 			cerr << "Unable to properly simplify due to fragmented parametrization\n"
 				 << "Try to reduce the size of the nodes using -f (default is 32768)" << endl;
 			exit(0);
 		}
 
 		//save node in nexus temporary structure
-		mesh_size = tmp.serializedSize(header.signature);
+		mesh_size = mesh.serializedSize(header.signature);
 	}
 	mesh_size = pad(mesh_size);
 	uchar *buffer = new uchar[mesh_size];
@@ -620,41 +968,64 @@ void NexusBuilder::processBlock(KDTreeSoup *input, StreamSoup *output, uint bloc
 	float error;
 	float pixelXedge;
 	if(!hasTextures()) {
+		ProfileScope scope("serialize", mesh_size);
 		mesh1.serialize(buffer, header.signature, node_patches);
 
 
 	} else {
 
 		if(useNodeTex) {
-			QImage nodetex = extractNodeTex(tmp, level, error, pixelXedge);
-			tmp.serialize(buffer, header.signature, node_patches);
+			QImage nodetex;
+			{
+				ProfileScope scope("extractNodeTex");
+				nodetex = extractNodeTex(mesh, level, error, pixelXedge);
+			}
+			{
+				ProfileScope scope("serialize", mesh_size);
+				mesh.serialize(buffer, header.signature, node_patches);
+			}
 
 			Texture t;
 
+			//encode in a per thread buffer, only the append is serialized.
+			static thread_local QByteArray jpg;
 			{
-				QMutexLocker locker(&m_textures);
-				t.offset = nodeTex.size()/NEXUS_PADDING;
-
-				output_pixels += nodetex.width()*nodetex.height();
-
-				QImageWriter writer(&nodeTex, "jpg");
+				ProfileScope scope("jpeg");
+				if(jpg.capacity() == 0)
+					jpg.reserve(1<<20); //reserved capacity survives the truncation in open
+				QBuffer jpgbuffer(&jpg);
+				jpgbuffer.open(QIODevice::WriteOnly);
+				QImageWriter writer(&jpgbuffer, "jpg");
 				writer.setQuality(tex_quality);
 #if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
 				writer.setOptimizedWrite(true);
 				writer.setProgressiveScanWrite(true);
 #endif
-				writer.write(nodetex);
+				if(!writer.write(nodetex))
+					throw QString("Failed encoding node texture: ") + writer.errorString();
+				scope.addBytes(jpg.size());
+			}
+			//textures must stay sorted by offset (their size is the distance to the next one):
+			//the record is pushed in the same section that appends the image.
+			quint32 texture_index;
+			{
+				ProfileLocker locker(&m_textures, "m_textures");
+				t.offset = nodeTex.size()/NEXUS_PADDING;
+
+				output_pixels += nodetex.width()*nodetex.height();
+
+				if(nodeTex.write(jpg) != jpg.size())
+					throw QString("Failed writing node texture: ") + nodeTex.errorString();
 
 				quint64 size = pad(nodeTex.size());
 				nodeTex.resize(size);
 				nodeTex.seek(size);
-			}
-			{
-				QMutexLocker locker(&m_builder);
+
 				textures.push_back(t);
-				for(Patch &patch: node_patches)
-					patch.texture = textures.size()-1; //last texture inserted
+				texture_index = textures.size()-1;
 			}
+			for(Patch &patch: node_patches)
+				patch.texture = texture_index;
 
 			//#define DEBUG_TEXTURES
 #ifdef DEBUG_TEXTURES
@@ -665,8 +1036,8 @@ void NexusBuilder::processBlock(KDTreeSoup *input, StreamSoup *output, uint bloc
 			rewriter.setQuality(tex_quality);
 			rewriter.write(nodetex);
 
-			tmp.textures.push_back(texname.toStdString());
-			tmp.savePlyTex(QString::number(counter) + ".ply", texname);
+			mesh.textures.push_back(texname.toStdString());
+			mesh.savePlyTex(QString::number(counter) + ".ply", texname);
 			counter++;
 #endif
 		}
@@ -679,11 +1050,13 @@ void NexusBuilder::processBlock(KDTreeSoup *input, StreamSoup *output, uint bloc
 	quint32 chunk;
 	//done serializing, move the data to the chunk.
 	{
-		QMutexLocker locker(&m_chunks);
+#ifdef WIN32
+		ProfileLocker locker(&m_chunks, "m_chunks"); //growing the file unmaps all the chunks on windows.
+#endif
 		chunk = chunks.addChunk(mesh_size);
-		uchar *chunk_buffer = chunks.getChunk(chunk);
-		memcpy(chunk_buffer, buffer, mesh_size);
-		chunks.dropChunk(chunk); //no neede anymore
+		BlockHandle handle = chunks.acquireChunk(chunk);
+		memcpy(handle.data, buffer, mesh_size);
+		handle.release(true); //no neede anymore
 	}
 	delete []buffer;
 
@@ -692,24 +1065,31 @@ void NexusBuilder::processBlock(KDTreeSoup *input, StreamSoup *output, uint bloc
 	nx::Node node;
 	if(!hasTextures())
 		node = mesh1.getNode(); //get node data before simplification
-	else
-		node = tmp.getNode();
+	else {
+		node = mesh.getNode();
+		mesh.unsplitSeams(); //simplification works on the original texture coordinates
+	}
 
 
 	int nface;
 	{
+		ProfileScope scope("simplify", ntriangles*sizeof(Triangle));
 
 		if(!hasTextures()) {
 			mesh1.lockVertices();
-			{ //needed only if Mesh::QUADRICS
-				QMutexLocker locker(&m_texsimply);
-				mesh1.quadricInit();
+			if(flatSimplify) {
+				error = mesh1.simplify(ntriangles*scaling, Mesh::FLAT_QUADRICS, block_threads);
+			} else {
+				{ //needed only if Mesh::QUADRICS
+					ProfileLocker locker(&m_texsimply, "m_texsimply");
+					mesh1.quadricInit();
+				}
+				error = mesh1.simplify(ntriangles*scaling, Mesh::QUADRICS);
 			}
-			error = mesh1.simplify(ntriangles*scaling, Mesh::QUADRICS);
 			nface = mesh1.fn;
 
 		} else {
-			QMutexLocker locker(&m_texsimply);
+			//the textured quadric helper keeps its state per thread.
 			int nvert = ntriangles*scaling;
 
 			if(skipSimplifyLevels > 0)
@@ -728,7 +1108,7 @@ void NexusBuilder::processBlock(KDTreeSoup *input, StreamSoup *output, uint bloc
 
 	quint32 current_node;
 	{
-		QMutexLocker locker(&m_builder);
+		ProfileLocker locker(&m_builder, "m_builder");
 
 		//patches will be reverted later, but the local order is important because of triangle_offset
 		quint32 patch_offset = patches.size();
@@ -761,13 +1141,18 @@ void NexusBuilder::processBlock(KDTreeSoup *input, StreamSoup *output, uint bloc
 		mesh.getTriangles(triangles, current_node);
 	}
 
-	{
-		QMutexLocker locker(&m_output);
-		for(int i = 0; i < nface; i++) {
-			Triangle &t = triangles[i];
-			if(!t.isDegenerate())
-				output->pushTriangle(triangles[i]);
-		}
+	//compact the private buffer here, only the bulk append is serialized.
+	int count = 0;
+	for(int i = 0; i < nface; i++) {
+		if(!triangles[i].isDegenerate())
+			triangles[count++] = triangles[i];
+	}
+
+	if(next_tree) {
+		pushNext(block, triangles, count);
+	} else {
+		ProfileLocker locker(&m_output, "m_output");
+		output->pushTriangles(triangles, count);
 	}
 	delete []triangles;
 }
@@ -778,14 +1163,95 @@ void NexusBuilder::createMeshLevel(KDTreeSoup *input, StreamSoup *output, int le
 		atlas.flush(level-1);
 
 
+	std::vector<uint> blocks = largestFirst(input);
+	//top levels have fewer blocks than workers: the idle ones help simplifying each block.
+	block_threads = std::max<int>(1, n_threads/std::max<size_t>(blocks.size(), 1));
+
+	if(next_tree) {
+		block_rank.assign(input->nBlocks(), 0);
+		for(quint32 i = 0; i < blocks.size(); i++)
+			block_rank[blocks[i]] = i;
+		pending.assign(blocks.size(), std::vector<Triangle>());
+		pending_ready.assign(blocks.size(), 0);
+		next_rank = 0;
+		feeding = false;
+	}
+
 	QThreadPool pool;
 	pool.setMaxThreadCount(n_threads);
 
-	for(uint block = 0; block < input->nBlocks(); block++) {
-		Worker *worker = new Worker(*this, input, output, block, level);
+	for(uint block: blocks) {
+		Worker<KDTreeSoup, StreamSoup> *worker = new Worker<KDTreeSoup, StreamSoup>(*this, input, output, block, level);
 		pool.start(worker);
 	}
 	pool.waitForDone();
+	rethrowWorkerError();
+	assert(!next_tree || next_rank == blocks.size());
+}
+
+/* pipelined construction: the triangles of the next level arrive one block at a time, each block compact in space,
+   splitting on them would give unbalanced cells. The next tree is split in advance on a sample of the current level
+   input, which has the same distribution of the output (every block is simplified by the same ratio). */
+void NexusBuilder::presplit(KDTreeSoup *input, KDTreeSoup *next) {
+	quint64 total = input->size();
+	if(!total)
+		return;
+	//a few hundred samples per output block are enough for the medians, sampled pages are not read whole.
+	quint64 wanted = std::min<quint64>(256*(input->nBlocks() + 1), max_memory/(4*sizeof(Triangle)));
+	quint64 stride = std::max<quint64>(1, total/std::max<quint64>(wanted, 1));
+
+	std::vector<Triangle> sample;
+	sample.reserve(total/stride + 1);
+	quint64 index = 0;
+	for(uint block = 0; block < input->nBlocks(); block++) {
+		quint32 used = input->blockUsed(block);
+		if(!used)
+			continue;
+		Soup soup = input->get(block);
+		quint64 first = (stride - index % stride) % stride;
+		for(quint64 i = first; i < used; i += stride)
+			sample.push_back(soup[i]);
+		index += used;
+		input->drop(block);
+	}
+	float ratio = skipSimplifyLevels > 0 ? 1.0f : scaling;
+	next->presplit(sample, total*ratio/sample.size());
+}
+
+/* the next tree is filled in submission order, so its splits and the content of its blocks do not depend on which
+   worker completes first. Workers only park their output, one of them at a time pushes the blocks ready in order
+   (outside of m_output). At most pending_window blocks wait, a worker too far ahead waits for the others. */
+void NexusBuilder::pushNext(uint block, Triangle *triangles, int count) {
+	static const quint32 pending_window = 64;
+	quint32 rank = block_rank[block];
+	{
+		ProfileLocker locker(&m_output, "m_output");
+		while(!worker_error && rank >= next_rank + std::max<quint32>(pending_window, 2*n_threads))
+			pending_room.wait(&m_output);
+		if(worker_error) //the level is lost anyway
+			return;
+		pending[rank].assign(triangles, triangles + count);
+		pending_ready[rank] = 1;
+		if(feeding)
+			return;
+		feeding = true;
+	}
+	std::vector<Triangle> batch;
+	while(true) {
+		{
+			ProfileLocker locker(&m_output, "m_output");
+			batch.clear();
+			if(worker_error || next_rank == pending.size() || !pending_ready[next_rank]) {
+				feeding = false;
+				return;
+			}
+			batch.swap(pending[next_rank]);
+			next_rank++;
+			pending_room.wakeAll();
+		}
+		for(Triangle &t: batch)
+			next_tree->pushTriangle(t);
+	}
 }
 
 
@@ -803,6 +1269,7 @@ void NexusBuilder::createLevel(KDTree *in, Stream *out, int level) {
 }
 
 void NexusBuilder::saturate() {
+	ProfileScope profile("saturate");
 	//we do not have the 'backlinks' so we make a depth first traversal
 	//TODO! BIG assumption: the nodes are ordered such that child comes always after parent
 	for(int node = nodes.size()-2; node >= 0; node--)
@@ -854,6 +1321,7 @@ void NexusBuilder::reverseDag() {
 
 
 void NexusBuilder::save(QString filename) {
+	ProfileScope profile("save");
 
 	//cout << "Input squaresize " << sqrt(input_pixels) <<  " Output size " << sqrt(output_pixels) << "\n";
 
@@ -954,17 +1422,39 @@ void NexusBuilder::save(QString filename) {
 		QDir dir;
 		dir.mkdir(basename);
 	}
-	for(uint i = 0; i < node_chunk.size(); i++) {
-		quint32 chunk = node_chunk[i];
-		uchar *buffer = chunks.getChunk(chunk);
-		optimizeNode(i, buffer);
-		if(header.signature.flags & Signature::Flags::DEEPZOOM) {
-			QFile nodefile(QString("%1/%2.nxn").arg(basename).arg(i));
-			nodefile.open(QFile::WriteOnly);
-			nodefile.write((char*)buffer, chunks.chunkSize(chunk));
-		} else
-			file.write((char*)buffer, chunks.chunkSize(chunk));
+	//nodes are optimized in parallel a batch at a time, and written in order.
+	CacheStats before, after;
+	quint32 batch = 8*n_threads;
+	for(quint32 first = 0; first < node_chunk.size(); first += batch) {
+		quint32 last = std::min<quint32>(first + batch, node_chunk.size());
+		std::vector<uchar *> buffers;
+		for(quint32 i = first; i < last; i++)
+			buffers.push_back(chunks.pinChunk(node_chunk[i]));
+		for(quint32 i = last; i < std::min<quint32>(last + batch, node_chunk.size()); i++)
+			chunks.prefetchChunk(node_chunk[i]);
+
+		std::vector<CacheStats> node_before(last - first), node_after(last - first);
+		parallelFor(first, last, n_threads, [&](qint64 start, qint64 end) {
+			for(qint64 i = start; i < end; i++)
+				optimizeNode(i, buffers[i - first], node_before[i - first], node_after[i - first]);
+		}, 1);
+
+		for(quint32 i = first; i < last; i++) {
+			quint32 chunk = node_chunk[i];
+			uchar *buffer = buffers[i - first];
+			if(header.signature.flags & Signature::Flags::DEEPZOOM) {
+				QFile nodefile(QString("%1/%2.nxn").arg(basename).arg(i));
+				nodefile.open(QFile::WriteOnly);
+				nodefile.write((char*)buffer, chunks.chunkSize(chunk));
+			} else
+				file.write((char*)buffer, chunks.chunkSize(chunk));
+			chunks.unpinChunk(chunk);
+			before.add(node_before[i - first]);
+			after.add(node_after[i - first]);
+		}
 	}
+	if(after.faces)
+		cout << "Vertex cache ACMR " << before.acmr() << " -> " << after.acmr() << ", ATVR " << before.atvr() << " -> " << after.atvr() << endl;
 
 	//TEXTURES
 	//	QString basename = filename.left(filename.length()-4);
@@ -1051,171 +1541,250 @@ void NexusBuilder::saturateNode(quint32 n) {
 	node.sphere.Radius() *= epsilon;
 }
 
-void NexusBuilder::optimizeNode(quint32 n, uchar *chunk) {
-	return;
+void NexusBuilder::optimizeNode(quint32 n, uchar *chunk, CacheStats &before, CacheStats &after) {
 	Node &node = nodes[n];
-	assert(node.nface);
-
-	uint16_t *faces = (uint16_t  *)(chunk + node.nvert*header.signature.vertex.size());
-
-	uint start =  0;
-	for(uint i = node.first_patch; i < node.last_patch(); i++) {
-		Patch &patch = patches[i];
-		uint end = patch.triangle_offset;
-		uint nface = end - start;
-		//optimizing vertex cache.
-		quint16 *triangles = new quint16[nface*3];
-
-		bool success = vmath::vertex_cache_optimizer::optimize_post_tnl(24, faces + 3*start, nface, node.nvert,  triangles);
-		if(success)
-			memcpy(faces + start, triangles, 3*sizeof(quint16)*nface);
-		else
-			cout << "Failed cache optimization" << endl;
-		delete []triangles;
-		start = end;
-	}
+	NodeOptimizer optimizer(header.signature);
+	optimizer.optimize(chunk, node.nvert, node.nface, &patches[node.first_patch], &patches[node.last_patch()], before, after);
 }
 
-/* extracts vertices in origin which intersects destination box */
-void NexusBuilder::appendBorderVertices(uint32_t origin, uint32_t destination, std::vector<NVertex> &vertices) {
+/* extracts vertices in origin which are on the border of its box */
+void NexusBuilder::appendBorderVertices(uint32_t origin, uchar *buffer, std::vector<NVertex> &vertices) {
 	Node &node = nodes[origin];
-	uint32_t chunk = node.offset; //chunk index was stored here.
-
-
-	//if origin != destination do not flush cache, it would invalidate pointers.
-	uchar *buffer = chunks.getChunk(chunk, origin != destination);
 
 	vcg::Point3f *point = (vcg::Point3f *)buffer;
-	int size = sizeof(vcg::Point3f) + header.signature.vertex.hasTextures()*sizeof(vcg::Point2f);
-	vcg::Point3s *normal = (vcg::Point3s *)(buffer + size * node.nvert);
+	vcg::Point3s *normal = nodeNormals(origin, buffer);
 	uint16_t *face = (uint16_t *)(buffer + header.signature.vertex.size()*node.nvert);
 
 	NodeBox &nodebox = boxes[origin];
-	
+
 	vector<bool> border = nodebox.markBorders(node, point, face);
 	for(int i = 0; i < node.nvert; i++) {
 		if(border[i])
-			vertices.push_back(NVertex(origin, i, point[i], normal + i));
+			vertices.push_back(NVertex(origin, i, point[i], normal[i]));
+	}
+}
+
+vcg::Point3s *NexusBuilder::nodeNormals(uint32_t n, uchar *buffer) {
+	int size = sizeof(vcg::Point3f) + header.signature.vertex.hasTextures()*sizeof(vcg::Point2f);
+	return (vcg::Point3s *)(buffer + size * nodes[n].nvert);
+}
+
+//coincident vertices must hash the same: -0 and 0 are equal.
+static quint32 pointHash(const vcg::Point3f &p) {
+	quint32 h = 0;
+	for(int k = 0; k < 3; k++) {
+		float c = p[k] + 0.0f;
+		quint32 bits;
+		memcpy(&bits, &c, sizeof(bits));
+		h = (h ^ bits)*16777619u;
 	}
+	return h ^ (h >> 15);
 }
 
+struct PointHash {
+	size_t operator()(const vcg::Point3f &p) const { return pointHash(p); }
+};
+
+struct NormalSum {
+	vcg::Point3f normal = vcg::Point3f(0, 0, 0);
+	int count = 0;
+};
 
 void NexusBuilder::uniformNormals() {
+	ProfileScope profile("uniformNormals");
 	cout << "Unifying normals\n";
 	/*
-	level 0: for each node in the lowest level:
-			load the neighboroughs
-			find common vertices (use lock to find the vertices)
+	level 0: all the nodes in the lowest level at once, one group of hash shards at a time (see below):
+			collect the border vertices
+			find coincident vertices (hash on position, in parallel on disjoint hash ranges)
 			average normals
 
-	level > 0: for every other node (goind backwards)
+	level > 0: every other node, one level at a time, the nodes of a level in parallel
 			load child nodes
-			find common vertices (use lock, it's way faster!)
-			copy normal
+			find common vertices (hash on position)
+			copy the normal of the deepest child into the node (only the node is written, children are already done)
 	*/
 
-	std::vector<NVertex> vertices;
-
 	uint32_t sink = nodes.size()-1;
+
+	std::vector<uint32_t> leaves;
+	std::vector<std::vector<uint32_t>> levels; //level 1 is the parents of the leaves
+	std::vector<int> height(nodes.size(), 0);
 	for(int t = sink-1; t > 0; t--) {
 		Node &target = nodes[t];
+		if(patches[target.first_patch].node == sink) {
+			leaves.push_back(t);
+			continue;
+		}
+		for(uint p = target.first_patch; p < target.last_patch(); p++)
+			height[t] = std::max(height[t], height[patches[p].node] + 1);
+		if(levels.size() <= (size_t)height[t])
+			levels.resize(height[t] + 1);
+		levels[height[t]].push_back(t);
+	}
 
-		vcg::Box3f box = boxes[t].box;
-		//box.Offset(box.Diag()/100);
-		box.Offset(box.Diag()/10);
-
-		vertices.clear();
-		appendBorderVertices(t, t, vertices);
-
-		bool last_level = (patches[target.first_patch].node == sink);
-
-		if(last_level) {//find neighboroughs among the same level
-
-			for(int n = t-1; n >= 0; n--) {
-				Node &node = nodes[n];
-				if(patches[node.first_patch].node != sink) continue;
-				if(!box.Collide(boxes[n].box)) continue;
-
-				appendBorderVertices(n, t, vertices);
+	//chunks are pinned a batch at a time on this thread, the nodes of the batch are processed in parallel.
+	std::vector<uchar *> buffers(nodes.size(), nullptr);
+	auto forEachNode = [&](const std::vector<uint32_t> &targets, bool children, std::function<void(uint32_t)> process) {
+		quint32 batch = 8*n_threads;
+		for(quint32 first = 0; first < targets.size(); first += batch) {
+			quint32 last = std::min<quint32>(first + batch, targets.size());
+			std::vector<uint32_t> pinned;
+			for(quint32 i = first; i < last; i++) {
+				uint32_t t = targets[i];
+				pinned.push_back(t);
+				if(children)
+					for(uint p = nodes[t].first_patch; p < nodes[t].last_patch(); p++)
+						pinned.push_back(patches[p].node);
 			}
+			for(uint32_t n: pinned)
+				buffers[n] = chunks.pinChunk(nodes[n].offset);
 
-		} else { //again among childrens.
+			parallelFor(first, last, n_threads, [&](qint64 start, qint64 end) {
+				for(qint64 i = start; i < end; i++)
+					process(i);
+			}, 1);
 
-			for(uint p = target.first_patch; p < target.last_patch(); p++) {
-				uint n = patches[p].node;
-
-				appendBorderVertices(n, t, vertices);
-			}
+			for(uint32_t n: pinned)
+				chunks.unpinChunk(nodes[n].offset);
 		}
-
-		if(!vertices.size()) { //this is possible, there might be no border at all.
-			continue;
+	};
+
+	//border vertices of each leaf, grouped by shard of the position hash.
+	const int shard_bits = 6;
+	const quint32 n_shards = 1<<shard_bits;
+	auto shardOf = [&](const vcg::Point3f &p) { return (pointHash(p)*2654435761u) >> (32 - shard_bits); };
+
+	/* the records of all the leaves might not fit in memory: the shards are processed in groups within a quarter
+	   of the budget, each group reading the leaves again. The vertex count bounds the border, when it does not
+	   fit the border is counted first. */
+	quint64 budget = std::max<quint64>(max_memory/4, 1<<20)/sizeof(NVertex);
+	quint64 bound = 0;
+	for(uint32_t t: leaves)
+		bound += nodes[t].nvert;
+	std::vector<quint32> groups = { 0 }; //first shard of each group
+	if(bound > budget) {
+		std::vector<quint64> counts(n_shards, 0);
+		QMutex m_counts;
+		forEachNode(leaves, false, [&](uint32_t i) {
+			std::vector<NVertex> vertices;
+			appendBorderVertices(leaves[i], buffers[leaves[i]], vertices);
+			std::vector<quint64> count(n_shards, 0);
+			for(NVertex &v: vertices)
+				count[shardOf(v.point)]++;
+			QMutexLocker locker(&m_counts);
+			for(quint32 s = 0; s < n_shards; s++)
+				counts[s] += count[s];
+		});
+		quint64 size = 0;
+		for(quint32 s = 0; s < n_shards; s++) {
+			if(size && size + counts[s] > budget) {
+				groups.push_back(s);
+				size = 0;
+			}
+			size += counts[s];
 		}
-
-		sort(vertices.begin(), vertices.end());
-
-		uint start = 0;
-		while(start < vertices.size()) {
-			NVertex &v = vertices[start];
-			
-			uint last = start+1;
-			while(last < vertices.size() && vertices[last].point == v.point)
-				last++;
-
-			if(last_level && last - start > 1) { //average all normals
-				vcg::Point3f normalf(0, 0, 0);
-				for(uint k = start; k < last; k++) {
-					for(int l = 0; l < 3; l++)
-						normalf[l] += (*vertices[k].normal)[l];
+	}
+	groups.push_back(n_shards);
+
+	for(size_t g = 0; g + 1 < groups.size(); g++) {
+		quint32 first_shard = groups[g];
+		quint32 group_shards = groups[g+1] - first_shard;
+
+		std::vector<std::vector<NVertex>> borders(leaves.size());
+		std::vector<std::vector<quint32>> offsets(leaves.size());
+		forEachNode(leaves, false, [&](uint32_t i) {
+			std::vector<NVertex> vertices;
+			appendBorderVertices(leaves[i], buffers[leaves[i]], vertices);
+
+			std::vector<quint32> &offset = offsets[i];
+			offset.assign(group_shards + 1, 0);
+			for(NVertex &v: vertices) {
+				quint32 s = shardOf(v.point) - first_shard;
+				if(s < group_shards)
+					offset[s + 1]++;
+			}
+			for(quint32 s = 0; s < group_shards; s++)
+				offset[s+1] += offset[s];
+			std::vector<quint32> fill(offset.begin(), offset.end() - 1);
+			std::vector<NVertex> &sorted = borders[i];
+			sorted.resize(offset.back());
+			for(NVertex &v: vertices) {
+				quint32 s = shardOf(v.point) - first_shard;
+				if(s < group_shards)
+					sorted[fill[s]++] = v;
+			}
+		});
+
+		//each shard owns the same hash range in every leaf: no two threads touch the same vertex.
+		parallelFor(0, group_shards, n_threads, [&](qint64 start, qint64 end) {
+			std::unordered_map<vcg::Point3f, NormalSum, PointHash> sums;
+			for(qint64 s = start; s < end; s++) {
+				sums.clear();
+				for(size_t i = 0; i < leaves.size(); i++) {
+					for(quint32 k = offsets[i][s]; k < offsets[i][s+1]; k++) {
+						NVertex &v = borders[i][k];
+						auto &sum = sums[v.point];
+						for(int l = 0; l < 3; l++)
+							sum.normal[l] += v.normal[l];
+						sum.count++;
+					}
 				}
-				normalf.Normalize();
-				//convert back to shorts
-				vcg::Point3s normals;
-				for(int l = 0; l < 3; l++)
-					normals[l] = (short)(normalf[l]*32766);
-
-				for(uint k = start; k < last; k++)
-					*vertices[k].normal = normals;
-				
-			} else //just copy from first one (coming from lower level due to sorting
-				for(uint k = start; k < last; k++)
-					*vertices[k].normal =*v.normal;
-			
-			start = last;
-		}
+				for(size_t i = 0; i < leaves.size(); i++) {
+					for(quint32 k = offsets[i][s]; k < offsets[i][s+1]; k++) {
+						NVertex &v = borders[i][k];
+						NormalSum &sum = sums[v.point];
+						if(sum.count < 2) continue;
 
-		
-		/*		for(uint k = 0; k < vertices.size(); k++) {
-			NVertex &v = vertices[k];
-			if(v.point != previous) {
-				//uniform normals;
-				if(k - last > 1) {   //more than 1 vertex to unify
-
-					if(last_level) {     //average all normals of the coincident points.
-
-						vcg::Point3f normalf(0, 0, 0);
-
-						for(uint j = last; j < k; j++)
-							for(int l = 0; l < 3; l++)
-								normalf[l] += (*vertices[j].normal)[l];
+						vcg::Point3f normalf = sum.normal;
 						normalf.Normalize();
-
 						//convert back to shorts
-						vcg::Point3s normals;
 						for(int l = 0; l < 3; l++)
-							normals[l] = (short)(normalf[l]*32766);
-
-						for(uint j = last; j < k; j++)
-							*vertices[j].normal = normals;
-
-					} else { //just copy the first one (it's from the lowest level, due to sort)
-						if(vertices[k-1].node == t) //unless this vertex do not belongs to t.
-							*vertices[k-1].normal = *vertices[last].normal;
+							v.normal[l] = (short)(normalf[l]*32766);
 					}
 				}
-				previous = v.point;
-				last = k;
 			}
-		}*/
+		}, 1);
+
+		forEachNode(leaves, false, [&](uint32_t i) {
+			vcg::Point3s *normals = nodeNormals(leaves[i], buffers[leaves[i]]);
+			for(NVertex &v: borders[i])
+				normals[v.index] = v.normal;
+			std::vector<NVertex>().swap(borders[i]);
+		});
+	}
+
+	//children are always at a lower level than their parents.
+	for(size_t h = 1; h < levels.size(); h++) {
+		forEachNode(levels[h], true, [&](uint32_t i) {
+			uint32_t t = levels[h][i];
+			Node &target = nodes[t];
+
+			std::vector<NVertex> vertices;
+			for(uint p = target.first_patch; p < target.last_patch(); p++) {
+				uint32_t child = patches[p].node;
+				appendBorderVertices(child, buffers[child], vertices);
+			}
+			if(!vertices.size()) //this is possible, there might be no border at all.
+				return;
+
+			//the deepest (highest order) child wins, as it has the most accurate normal
+			std::unordered_map<vcg::Point3f, const NVertex *, PointHash> deepest;
+			deepest.reserve(vertices.size());
+			for(NVertex &v: vertices) {
+				const NVertex *&d = deepest[v.point];
+				if(!d || v.node > d->node)
+					d = &v;
+			}
+
+			vertices.clear();
+			appendBorderVertices(t, buffers[t], vertices);
+			vcg::Point3s *normals = nodeNormals(t, buffers[t]);
+			for(NVertex &v: vertices) {
+				auto it = deepest.find(v.point);
+				if(it != deepest.end())
+					normals[v.index] = it->second->normal;
+			}
+		});
 	}
 }
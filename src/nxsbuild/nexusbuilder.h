@@ -19,20 +19,24 @@ for more details.
 #define NX_NEXUSBUILDER_H
 
 #include <vector>
+#include <exception>
 
 #include <QString>
 #include <QFile>
 #include <QMutex>
+#include <QWaitCondition>
 
 #include <vcg/space/box3.h>
 
 #include "../common/signature.h"
 #include "../common/dag.h"
 #include "../common/virtualarray.h"
+#include "trianglesoup.h"
 #include "texpyramid.h"
 
 
 
+struct CacheStats;
 class KDTree;
 class KDTreeSoup;
 class KDTreeCloud;
@@ -61,18 +65,13 @@ struct NodeBox {
 
 class NVertex {
 public:
-	NVertex(uint32_t b, uint32_t i, vcg::Point3f p, vcg::Point3s *n):
+	NVertex() {}
+	NVertex(uint32_t b, uint32_t i, vcg::Point3f p, vcg::Point3s n):
 		node(b), index(i), point(p), normal(n) {}
 	uint32_t node;
 	uint32_t index;
 	vcg::Point3f point;
-	vcg::Point3s *normal;
-
-	bool operator<(const NVertex &v) const {
-		if(point == v.point)
-			return node > v.node;  //ascending orde: the first will be the highest node order (the leafest node)
-		return point < v.point;
-	}
+	vcg::Point3s normal;   //a copy: chunks are not kept pinned
 };
 
 
@@ -89,6 +88,8 @@ public:
 	void initAtlas(std::vector<QImage>& textures);
 	bool initAtlas(std::vector<LoadTexture>& textures);
 	void create(KDTree *input, Stream *output, uint top_node_size);
+	//simplified triangles are pushed directly in the next level tree, (uses two trees, the stream is used only for level 0)
+	void createPipelined(KDTreeSoup *input, KDTreeSoup *next, StreamSoup *stream, uint top_node_size);
 	void createLevel(KDTree *input, Stream *output, int level);
 	void createCloudLevel(KDTreeCloud *input, StreamCloud *output, int level);
 	void createMeshLevel(KDTreeSoup *input, StreamSoup *output, int level);
@@ -106,12 +107,18 @@ public:
 	void reverseDag();
 	void save(QString filename);
 
-	QMutex m_input;     //locks input stream when building nodes multithread
+	//after each level the state needed to continue is saved in the checkpoint directory, (create() only)
+	//if resume is set create() starts from the last completed level.
+	QString checkpoint;
+	bool resume = false;
+	static int checkpointLevel(QString dir); //last completed level, 0 if there is no checkpoint
+	static std::vector<LoadTexture> checkpointTextures(QString dir); //textures of the input
+	static QString checkpointStream(QString dir, int level);
+
 	QMutex m_output;    //locks output stream stream when building nodes multithread
 	QMutex m_builder;   //locks builders data (patches, etc.)
-	QMutex m_chunks;    //locks builder chunks (the cache)
-	QMutex m_atlas;     //locks atlas (the cache)
-	QMutex m_texsimply;     //locks the temporary data simplification structure for texture. (UGH)
+	QMutex m_chunks;    //locks builder chunks when growing the file (windows only)
+	QMutex m_texsimply;     //locks Mesh::quadricInit, textured simplification does not need it anymore
 
 
 	QMutex m_textures;  //locks  texture temporary file
@@ -133,11 +140,21 @@ public:
 	QTemporaryFile nodeTex; //texure images for each node stored here.
 	quint64 max_memory;
 	int n_threads = 4;
+	int block_threads = 1; //threads simplifying a single block (flat decimation only), set per level
 
 	float scaling;
 	bool useNodeTex; //use node textures
+	bool flatSimplify = false; //FlatSimplifier for untextured meshes instead of vcg quadrics
 	int tex_quality;
 	int max_node_triangles = 32000;
+	KDTreeSoup *next_tree = nullptr; //when pipelining output goes here instead of the stream
+	std::vector<quint32> block_rank;           //pipelined: submission order of the blocks
+	std::vector<std::vector<Triangle>> pending; //output of the blocks completed out of order
+	std::vector<char> pending_ready;
+	quint32 next_rank = 0;                     //next block to push
+	bool feeding = false;                      //a worker is pushing in next_tree
+	QWaitCondition pending_room;
+	std::exception_ptr worker_error;           //first exception thrown by a worker in the level (under m_output)
 	bool createPowTwoTex;
 	bool deepzoom = false; //use deepzoom style where each node is in a different file.
 	
@@ -145,15 +162,30 @@ public:
 	int skipSimplifyLevels = 0;
 
 	void processBlock(KDTreeSoup *input, StreamSoup *output, uint block, int level);
+	void presplit(KDTreeSoup *input, KDTreeSoup *next);
+	void pushNext(uint block, Triangle *triangles, int count);
+	void processBlock(KDTreeCloud *input, StreamCloud *output, uint block, int level);
+	bool workerFailed();
+	void setWorkerError(std::exception_ptr error);
+	void rethrowWorkerError();
 
 	QImage extractNodeTex(TMesh &mesh, int level, float &error, float &pixelXedge);
 	void invertNodes(); //
 	void saturateNode(quint32 n);
-	void optimizeNode(quint32 node, uchar *chunk);
+	void optimizeNode(quint32 node, uchar *chunk, CacheStats &before, CacheStats &after); //thread safe
 	void uniformNormals();
-	void appendBorderVertices(uint32_t origin, uint32_t destination, std::vector<NVertex> &vertices);
+	void appendBorderVertices(uint32_t origin, uchar *buffer, std::vector<NVertex> &vertices);
+	vcg::Point3s *nodeNormals(uint32_t node, uchar *buffer);
 
 	void testSaturation();
+
+	std::vector<LoadTexture> input_textures; //the stream forgets them after level 0
+	int checkpoint_level = 0;             //last level saved
+	quint64 checkpoint_chunks = 0;        //chunks already saved
+	quint64 checkpoint_chunk_bytes = 0;
+	quint64 checkpoint_tex = 0;           //nodeTex bytes already saved
+	void saveCheckpoint(Stream *stream, int level, int last_top_level_size);
+	int restoreCheckpoint(int &last_top_level_size); //returns the level to start from
 };
 
 #endif // NX_NEXUSBUILDER_H
@@ -0,0 +1,179 @@
+/*
+Nexus
+
+Copyright(C) 2012 - Federico Ponchio
+ISTI - Italian National Research Council - Visual Computing Lab
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
+for more details.
+*/
+#include <algorithm>
+#include <string.h>
+
+#include "nodeoptimizer.h"
+#include "vertex_cache_optimizer.h" //includes memory.h inside its namespace: string.h must come first
+
+using namespace nx;
+
+void NodeOptimizer::simulate(const quint16 *faces, quint32 nface, quint32 nvert, int cache_size, CacheStats &stats) {
+	std::vector<quint32> stamp(nvert, 0); //value of misses when the vertex entered the cache, 0 never
+	quint32 misses = 0;
+	quint32 vertices = 0;
+	for(quint32 i = 0; i < nface*3; i++) {
+		quint16 v = faces[i];
+		if(stamp[v] && misses - stamp[v] < (quint32)cache_size)
+			continue;
+		if(!stamp[v])
+			vertices++;
+		stamp[v] = ++misses;
+	}
+	stats.misses += misses;
+	stats.faces += nface;
+	stats.vertices += vertices;
+}
+
+void NodeOptimizer::optimize(uchar *chunk, quint32 nvert, quint32 nface, Patch *begin, Patch *end,
+							 CacheStats &before, CacheStats &after) {
+	if(!signature.face.hasIndex() || !nvert || !nface)
+		return;
+
+	vcg::Point3f *coords = (vcg::Point3f *)chunk;
+	quint16 *faces = (quint16 *)(chunk + nvert*signature.vertex.size());
+
+	simulate(faces, nface, nvert, cache_size, before);
+
+	//triangle_offset is the END of the patch
+	quint32 start = 0;
+	for(Patch *patch = begin; patch != end; patch++) {
+		quint32 stop = patch->triangle_offset;
+		if(stop > start)
+			orderTriangles(faces + 3*start, stop - start, nvert, coords);
+		start = stop;
+	}
+	orderVertices(chunk, nvert, faces, nface);
+
+	simulate(faces, nface, nvert, cache_size, after);
+}
+
+bool NodeOptimizer::orderTriangles(quint16 *faces, quint32 nface, quint32 nvert, const vcg::Point3f *coords) {
+	std::vector<quint16> ordered(nface*3);
+	if(!vmath::vertex_cache_optimizer::optimize_post_tnl(cache_size, faces, (int)nface, (int)nvert, ordered.data()))
+		return false;
+
+	CacheStats total;
+	simulate(ordered.data(), nface, nvert, cache_size, total);
+	double threshold = lambda*total.acmr();
+
+	//split the sequence where the cache is warm enough that flushing it costs little (Sander et al. 2007)
+	std::vector<quint32> clusters(1, 0);
+	std::vector<quint32> stamp(nvert, 0);
+	quint32 misses = 0;
+	quint32 flushed = 0;   //stamps up to this are out of the cache
+	quint32 cluster_misses = 0;
+	for(quint32 i = 0; i < nface; i++) {
+		for(int k = 0; k < 3; k++) {
+			quint16 v = ordered[i*3 + k];
+			if(stamp[v] > flushed && misses - stamp[v] < (quint32)cache_size)
+				continue;
+			stamp[v] = ++misses;
+			cluster_misses++;
+		}
+		quint32 cluster_faces = i + 1 - clusters.back();
+		if(i + 1 < nface && cluster_misses <= threshold*cluster_faces) {
+			clusters.push_back(i + 1);
+			cluster_misses = 0;
+			flushed = misses;
+		}
+	}
+	clusters.push_back(nface);
+
+	if(clusters.size() <= 2) {
+		memcpy(faces, ordered.data(), nface*3*sizeof(quint16));
+		return true;
+	}
+
+	//draw first the clusters facing away from the center: they are more likely to occlude the others.
+	quint32 n_clusters = clusters.size() - 1;
+	std::vector<vcg::Point3f> centroids(n_clusters);
+	std::vector<vcg::Point3f> normals(n_clusters);
+	vcg::Point3f center(0, 0, 0);
+	float total_area = 0;
+	for(quint32 c = 0; c < n_clusters; c++) {
+		vcg::Point3f centroid(0, 0, 0);
+		vcg::Point3f normal(0, 0, 0);
+		float area = 0;
+		for(quint32 i = clusters[c]; i < clusters[c+1]; i++) {
+			const vcg::Point3f &p0 = coords[ordered[i*3]];
+			const vcg::Point3f &p1 = coords[ordered[i*3 + 1]];
+			const vcg::Point3f &p2 = coords[ordered[i*3 + 2]];
+			vcg::Point3f n = (p1 - p0)^(p2 - p0);
+			float a = n.Norm();
+			normal += n;
+			centroid += (p0 + p1 + p2)*(a/3.0f);
+			area += a;
+		}
+		if(area > 0)
+			centroid /= area;
+		else
+			centroid = coords[ordered[clusters[c]*3]];
+		center += centroid*area;
+		total_area += area;
+		centroids[c] = centroid;
+		if(normal.Norm() > 0)
+			normal.Normalize();
+		normals[c] = normal;
+	}
+	if(total_area > 0)
+		center /= total_area;
+
+	std::vector<std::pair<float, quint32>> order(n_clusters);
+	for(quint32 c = 0; c < n_clusters; c++)
+		order[c] = std::make_pair((centroids[c] - center)*normals[c], c);
+	std::stable_sort(order.begin(), order.end(),
+					 [](const std::pair<float, quint32> &a, const std::pair<float, quint32> &b) { return a.first > b.first; });
+
+	quint16 *out = faces;
+	for(auto &o: order) {
+		quint32 c = o.second;
+		quint32 n = clusters[c+1] - clusters[c];
+		memcpy(out, ordered.data() + clusters[c]*3, n*3*sizeof(quint16));
+		out += n*3;
+	}
+	return true;
+}
+
+void NodeOptimizer::orderVertices(uchar *chunk, quint32 nvert, quint16 *faces, quint32 nface) {
+	std::vector<qint32> remap(nvert, -1);
+	qint32 count = 0;
+	for(quint32 i = 0; i < nface*3; i++) {
+		quint16 &v = faces[i];
+		if(remap[v] < 0)
+			remap[v] = count++;
+		v = remap[v];
+	}
+	for(quint32 v = 0; v < nvert; v++)
+		if(remap[v] < 0)
+			remap[v] = count++;
+
+	//attribute arrays are stored one after the other in this order (see Mesh::serialize and TMesh::serialize)
+	const int order[] = { VertexElement::COORD, VertexElement::TEX, VertexElement::NORM, VertexElement::COLOR,
+						  VertexElement::DATA0, VertexElement::DATA0 + 1, VertexElement::DATA0 + 2, VertexElement::DATA0 + 3 };
+	std::vector<uchar> tmp;
+	uchar *array = chunk;
+	for(int c: order) {
+		quint32 size = signature.vertex.attributes[c].size();
+		if(!size) continue;
+		tmp.assign(array, array + size*nvert);
+		for(quint32 v = 0; v < nvert; v++)
+			memcpy(array + remap[v]*size, tmp.data() + v*size, size);
+		array += size*nvert;
+	}
+}
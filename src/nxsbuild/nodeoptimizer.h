@@ -0,0 +1,66 @@
+/*
+Nexus
+
+Copyright(C) 2012 - Federico Ponchio
+ISTI - Italian National Research Council - Visual Computing Lab
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
+for more details.
+*/
+#ifndef NX_NODEOPTIMIZER_H
+#define NX_NODEOPTIMIZER_H
+
+#include <QtGlobal>
+#include <vector>
+
+#include <vcg/space/point3.h>
+#include "../common/signature.h"
+#include "../common/dag.h"
+
+//post transform cache simulation: ACMR is misses per triangle, ATVR misses per referenced vertex (1.0 is optimal).
+struct CacheStats {
+	quint64 misses = 0;
+	quint64 faces = 0;
+	quint64 vertices = 0;
+
+	void add(const CacheStats &s) {
+		misses += s.misses;
+		faces += s.faces;
+		vertices += s.vertices;
+	}
+	double acmr() const { return faces ? misses/(double)faces : 0.0; }
+	double atvr() const { return vertices ? misses/(double)vertices : 0.0; }
+};
+
+/* reorders a serialized node for rendering: the triangles of each patch for the vertex cache (tipsify)
+   and then for overdraw (clusters facing outward are drawn first), the vertices in order of first use.
+   Patches keep their triangle ranges. */
+
+class NodeOptimizer {
+public:
+	int cache_size = 24;     //fifo entries
+	float lambda = 1.05f;    //cluster boundaries are accepted where acmr is within lambda of the whole patch.
+
+	NodeOptimizer(const nx::Signature &sig): signature(sig) {}
+
+	void optimize(uchar *chunk, quint32 nvert, quint32 nface, nx::Patch *begin, nx::Patch *end,
+				  CacheStats &before, CacheStats &after);
+
+	static void simulate(const quint16 *faces, quint32 nface, quint32 nvert, int cache_size, CacheStats &stats);
+
+protected:
+	nx::Signature signature;
+
+	bool orderTriangles(quint16 *faces, quint32 nface, quint32 nvert, const vcg::Point3f *coords);
+	void orderVertices(uchar *chunk, quint32 nvert, quint16 *faces, quint32 nface);
+};
+
+#endif // NX_NODEOPTIMIZER_H
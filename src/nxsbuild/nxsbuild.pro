@@ -22,6 +22,7 @@ SOURCES += \
     ../../../vcglib/wrap/system/qgetopt.cpp \
     ../../../vcglib/wrap/ply/plylib.cpp \
     ../common/virtualarray.cpp \
+    ../common/blockcodec.cpp \
     ../common/cone.cpp \
     colormap.cpp \
     main.cpp \
@@ -32,10 +33,14 @@ SOURCES += \
     mesh.cpp \
     tsploader.cpp \
     nexusbuilder.cpp \
+    nodeoptimizer.cpp \
+    flatsimplifier.cpp \
+    packedsoup.cpp \
     objloader.cpp \
     tmesh.cpp \
     texpyramid.cpp \
     stlloader.cpp \
+    profiler.cpp \
     tsloader.cpp
 
 HEADERS += \
@@ -44,16 +49,23 @@ HEADERS += \
     ../common/signature.h \
     ../common/cone.h \
     ../common/virtualarray.h \
+    ../common/blockcodec.h \
     colormap.h \
     meshstream.h \
     meshloader.h \
     plyloader.h \
     partition.h \
+    parallel.h \
+    checkpoint.h \
+    profiler.h \
     kdtree.h \
     trianglesoup.h \
     mesh.h \
     tsploader.h \
     nexusbuilder.h \
+    nodeoptimizer.h \
+    flatsimplifier.h \
+    packedsoup.h \
     objloader.h \
     tmesh.h \
     vertex_cache_optimizer.h \
@@ -16,10 +16,12 @@ GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
 for more details.
 */
 #include "objloader.h"
+#include "parallel.h"
 #include <QFileInfo>
 #include <QDir>
 #include <QTextStream>
 #include <iostream>
+#include <string.h>
 
 
 
@@ -28,6 +30,8 @@ for more details.
 #define BLUE(c) ((c >> 8) & 0xff)
 #define ALPHA(c) (c & 0xff)
 
+static const quint32 default_color = (0x7f << 24) + (0x7f << 16) + (0x7f << 8) + 255;
+
 
 ObjLoader::ObjLoader(QString filename, QString _mtl):
 	vertices("cache_plyvertex"),
@@ -41,9 +45,15 @@ ObjLoader::ObjLoader(QString filename, QString _mtl):
 		throw QString("could not open file %1. Error: %2").arg(filename).arg(file.errorString());
 
 	readMTL(file);
+
+	//fall back to the line by line parser if the file can't be mapped.
+	if(file.size() > 0)
+		data = file.map(0, file.size());
 }
 
 ObjLoader::~ObjLoader() {
+	if(data)
+		file.unmap(data);
 	file.close();
 }
 
@@ -303,23 +313,57 @@ void ObjLoader::setMaxMemory(quint64 max_memory) {
 
 
 
+void ObjLoader::useMaterial(QString name, quint32 &color, qint32 &texture_id) {
+	color = colors_map.value(name);
+	if (!color)
+		color = default_color;
+
+	texture_id = -1;
+	QString txtfname = textures_map.value(name);
+	if (txtfname.length() > 0) {
+		for (int i = 0; i < texture_filenames.size(); i++) {
+			if (texture_filenames[i].filename == txtfname)
+				texture_id = i;
+		}
+	}
+}
+
 quint32 ObjLoader::getTriangles(quint32 size, Triangle *faces) {
 
-	if (n_triangles == 0) {
-		cacheVertices();
-		cacheTextureUV();
+	if (data) {
+		if (!cached)
+			cacheParallel();
+
+		while (pending_used == pending.size()) {
+			if (current_chunk == chunks.size()) {
+				std::cout << "faces read: " << n_triangles << std::endl;
+				return 0;
+			}
+			//parse a group of chunks, one per thread.
+			quint64 group = std::min<quint64>(std::max(n_threads, 1), chunks.size() - current_chunk);
+			std::vector<std::vector<Triangle> > parsed(group);
+			parallelFor(0, group, n_threads, [&](qint64 start, qint64 end) {
+				for (qint64 i = start; i < end; i++)
+					parseFaces(chunks[current_chunk + i], parsed[i]);
+			}, 1);
+			current_chunk += group;
+
+			pending.clear();
+			pending_used = 0;
+			for (auto &triangles: parsed)
+				pending.insert(pending.end(), triangles.begin(), triangles.end());
+		}
+
+		quint32 count = (quint32)std::min<quint64>(size, pending.size() - pending_used);
+		std::copy(pending.begin() + pending_used, pending.begin() + pending_used + count, faces);
+		pending_used += count;
+		n_triangles += count;
+		return count;
 	}
 
 	char buffer[1024];
 	file.seek(current_tri_pos);
 
-	qint32 R = (0x7f << 24);
-	qint32 G = (0x7f << 16);
-	qint32 B = (0x7f << 8);
-
-	qint32 A = 255;
-	quint32 default_color = R + G + B + A;
-	
 	quint32 count = 0;
 	qint64 cpos = current_tri_pos;
 
@@ -333,26 +377,7 @@ quint32 ObjLoader::getTriangles(quint32 size, Triangle *faces) {
 
 		if (has_colors && buffer[0] == 'u') {
 			QString str = QString(buffer).simplified().section(" ", 1);
-			current_color = colors_map[str];
-			if (current_color) {
-				//cout << "cur color " << buffer+7 << " " << RED(current_color) <<" "<< GREEN(current_color) << " " << BLUE(current_color) << " " << endl;
-			}
-			else {
-				current_color = default_color;
-			}
-
-			current_texture_id = -1;
-			QString txtfname = textures_map[str];
-			if (txtfname.length() > 0) {
-				for (int i = 0; i < texture_filenames.size(); i++) {
-					if (texture_filenames[i].filename == txtfname)
-						current_texture_id = i;
-				}
-			}
-			
-			if (current_texture_id > -1) {
-				//cout << "txt ok: " << qPrintable(str) << " " << qPrintable(txtfname) << endl;
-			}
+			useMaterial(str, current_color, current_texture_id);
 			continue;
 		}
 
@@ -481,7 +506,7 @@ quint32 ObjLoader::getTriangles(quint32 size, Triangle *faces) {
 						for (int j = 0; j < 2; j++)
 							current.vertices[k].t[j] = vtxtuv[vtxt1[m * 3 + k] * 2 + j];
 				}
-				current.tex = current_texture_id;
+				current.tex = current_texture_id >= 0 ? current_texture_id + texOffset : -1;
 				if (has_colors && current_color) {
 					current.vertices[0].c[0] = RED(current_color);
 					current.vertices[0].c[1] = GREEN(current_color);
@@ -578,3 +603,205 @@ quint32 ObjLoader::getVertices(quint32 size, Splat *vertices) {
 	}
 	return count;
 }
+
+
+//PARALLEL PARSER
+
+static const qint64 chunk_size = 1<<23;
+
+static inline bool isBlank(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char *lineEnd(const char *p, const char *end) {
+	const char *nl = (const char *)memchr(p, '\n', end - p);
+	return nl ? nl : end;
+}
+
+void ObjLoader::cacheParallel() {
+	cached = true;
+	vertices.setElementsPerBlock(1<<20);
+
+	qint64 size = file.size();
+	for(qint64 start = 0; start < size; ) {
+		qint64 end = std::min(size, start + chunk_size);
+		if(end < size)
+			end = lineEnd((const char *)data + end - 1, (const char *)data + size) - (const char *)data + 1;
+		Chunk chunk;
+		chunk.start = start;
+		chunk.end = std::min(end, size);
+		chunks.push_back(chunk);
+		start = chunk.end;
+	}
+
+	struct Parsed {
+		std::vector<Vertex> vertices;
+		std::vector<float> uv;
+		vcg::Box3d box;
+	};
+
+	quint64 group = std::max(n_threads, 1);
+	for(quint64 first = 0; first < chunks.size(); first += group) {
+		quint64 last = std::min<quint64>(first + group, chunks.size());
+		std::vector<Parsed> parsed(last - first);
+
+		parallelFor(first, last, n_threads, [&](qint64 begin, qint64 end) {
+			for(qint64 c = begin; c < end; c++) {
+				Chunk &chunk = chunks[c];
+				Parsed &result = parsed[c - first];
+				const char *p = (const char *)data + chunk.start;
+				const char *chunk_end = (const char *)data + chunk.end;
+
+				while(p < chunk_end) {
+					const char *line = p;
+					const char *le = lineEnd(p, chunk_end);
+					p = le + 1;
+
+					if(line[0] == 'v' && line + 1 < le && (line[1] == ' ' || line[1] == '\t')) {
+						const char *q = line + 2;
+						vcg::Point3d point;
+						for(int k = 0; k < 3; k++)
+							if(!parseNumber(q, le, point[k]))
+								throw QString("error parsing vertex line %1 while caching").arg(QString::fromLatin1(line, le - line));
+						point -= origin;
+						point[0] *= scale[0];
+						point[1] *= scale[1];
+						point[2] *= scale[2];
+						result.box.Add(point);
+
+						Vertex vertex = Vertex();
+						for(int k = 0; k < 3; k++) {
+							vertex.v[k] = (float)point[k];
+							if(quantization)
+								quantize(vertex.v[k]);
+						}
+						result.vertices.push_back(vertex);
+
+					} else if(line[0] == 'v' && line + 2 < le && line[1] == 't' && line[2] == ' ') {
+						const char *q = line + 3;
+						for(int k = 0; k < 2; k++) {
+							double t;
+							if(!parseNumber(q, le, t))
+								throw QString("error parsing vtxt  line: %1").arg(QString::fromLatin1(line, le - line));
+							result.uv.push_back((float)t);
+						}
+
+					} else if(line[0] == 'u' && le - line > 6 && strncmp(line, "usemtl", 6) == 0) {
+						chunk.has_material = true;
+						chunk.material = QByteArray(line, le - line);
+					}
+				}
+			}
+		}, 1);
+
+		//append in file order.
+		for(Parsed &result: parsed) {
+			quint64 offset = n_vertices;
+			n_vertices += result.vertices.size();
+			vertices.resize(n_vertices);
+			for(quint64 i = 0; i < result.vertices.size(); i++)
+				vertices[offset + i] = result.vertices[i];
+			vtxtuv.insert(vtxtuv.end(), result.uv.begin(), result.uv.end());
+			box.Add(result.box);
+		}
+	}
+	std::cout << "Vertices read: " << n_vertices << std::endl;
+
+	//material state at the start of each chunk depends on the previous chunks.
+	quint32 color = 0;
+	qint32 texture_id = -1;
+	for(Chunk &chunk: chunks) {
+		chunk.color = color;
+		chunk.texture_id = texture_id;
+		if(has_colors && chunk.has_material)
+			useMaterial(QString(chunk.material).simplified().section(" ", 1), color, texture_id);
+	}
+}
+
+void ObjLoader::parseFaces(Chunk &chunk, std::vector<Triangle> &triangles) {
+	quint32 color = chunk.color;
+	qint32 texture_id = chunk.texture_id;
+	quint64 n_uv = vtxtuv.size()/2;
+
+	BlockHandle handle; //keeps the last used block of vertices mapped.
+	std::vector<qint64> face;
+	std::vector<qint64> uv;
+
+	const char *p = (const char *)data + chunk.start;
+	const char *chunk_end = (const char *)data + chunk.end;
+	while(p < chunk_end) {
+		const char *line = p;
+		const char *le = lineEnd(p, chunk_end);
+		p = le + 1;
+
+		if(has_colors && line[0] == 'u') {
+			QString str = QString::fromLatin1(line, le - line).simplified().section(" ", 1);
+			useMaterial(str, color, texture_id);
+			continue;
+		}
+		if(line[0] != 'f' || line + 1 >= le || (line[1] != ' ' && line[1] != '\t'))
+			continue;
+
+		face.clear();
+		uv.clear();
+		const char *q = line + 1;
+		while(true) {
+			while(q < le && isBlank(*q))
+				q++;
+			if(q >= le || *q == '#')
+				break;
+
+			qint64 rr[3] = { 0, 0, 0 };
+			int rri = 0;
+			for(; q < le && !isBlank(*q); q++) {
+				char c = *q;
+				if(c == '/') {
+					if(rri < 2) rri++;
+				} else if(c == '-') {
+					throw QString("Relative indexes in OBJ are not supported");
+				} else if(c >= '0' && c <= '9') {
+					rr[rri] = rr[rri]*10 + (c - '0');
+				} else
+					throw QString("could not parse face: %1").arg(QString::fromLatin1(line, le - line));
+			}
+			face.push_back(rr[0] - 1);
+			uv.push_back(rr[1] - 1);
+		}
+
+		int valence = face.size();
+		if(valence < 3)
+			throw QString("could not parse face: %1").arg(QString::fromLatin1(line, le - line));
+
+		for(int w = 0; w < valence; w++) {
+			if(face[w] < 0 || (quint64)face[w] >= n_vertices)
+				throw QString("Bad index in triangle list.");
+			if(uv[w] >= 0 && (quint64)uv[w] >= n_uv)
+				throw QString("Bad texture coordinate index in triangle list.");
+		}
+
+		for(int m = 0; m <= valence - 3; m++) {
+			int corners[3] = { 0, m + 1, m + 2 };
+			Triangle current;
+			for(int k = 0; k < 3; k++) {
+				int w = corners[k];
+				current.vertices[k] = vertices.at(face[w], handle);
+				if(uv[w] >= 0)
+					for(int j = 0; j < 2; j++)
+						current.vertices[k].t[j] = vtxtuv[uv[w] * 2 + j];
+			}
+			current.tex = texture_id >= 0 ? texture_id + texOffset : -1; //textures of the previous files come first
+			if(has_colors && color) {
+				for(int k = 0; k < 3; k++) {
+					current.vertices[k].c[0] = RED(color);
+					current.vertices[k].c[1] = GREEN(color);
+					current.vertices[k].c[2] = BLUE(color);
+					current.vertices[k].c[3] = ALPHA(color);
+				}
+			}
+			current.node = 0;
+			if(current.isDegenerate())
+				continue;
+			triangles.push_back(current);
+		}
+	}
+}
@@ -40,6 +40,26 @@ private:
 	void readMTL(QFile &file); //obj file passed to search for mtllib
 	void cacheTextureUV();
 	void cacheVertices();
+	void useMaterial(QString name, quint32 &color, qint32 &texture_id);
+
+	//parallel parser: the file is mapped and split in chunks on line boundaries,
+	//v and vt are cached in a first pass, faces are parsed in groups of chunks.
+	struct Chunk {
+		qint64 start, end;
+		bool has_material = false;
+		QByteArray material;     //last usemtl line in the chunk
+		quint32 color = 0;       //material state at the start of the chunk
+		qint32 texture_id = -1;
+	};
+	uchar *data = nullptr;
+	bool cached = false;
+	std::vector<Chunk> chunks;
+	quint64 current_chunk = 0;
+	std::vector<Triangle> pending;
+	quint64 pending_used = 0;
+
+	void cacheParallel();
+	void parseFaces(Chunk &chunk, std::vector<Triangle> &triangles);
 	
 	QFile file;
 	QString mtl;
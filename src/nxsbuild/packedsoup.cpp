@@ -0,0 +1,108 @@
+/*
+Nexus
+
+Copyright(C) 2012 - Federico Ponchio
+ISTI - Italian National Research Council - Visual Computing Lab
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
+for more details.
+*/
+#include <string.h>
+
+#include "packedsoup.h"
+
+static inline quint32 vertexHash(const Vertex &v) {
+	quint32 words[sizeof(Vertex)/4];
+	memcpy(words, &v, sizeof(Vertex));
+	quint32 h = 2166136261u;
+	for(quint32 w: words)
+		h = (h ^ w)*16777619u;
+	return h ^ (h >> 16);
+}
+
+quint64 PackedSoup::encode(const Triangle *triangles, quint32 n, std::vector<uchar> &buffer) {
+	std::vector<Vertex> vertices;
+	vertices.reserve(n*3/2);
+	std::vector<quint32> indices(n*3);
+
+	//open addressing on the whole vertex record
+	quint32 table_size = 1;
+	while(table_size < n*6)
+		table_size <<= 1;
+	quint32 mask = table_size - 1;
+	std::vector<qint32> table(table_size, -1);
+	for(quint32 i = 0; i < n*3; i++) {
+		const Vertex &v = triangles[i/3].vertices[i%3];
+		quint32 h = vertexHash(v) & mask;
+		while(table[h] >= 0 && memcmp(&vertices[table[h]], &v, sizeof(Vertex)))
+			h = (h + 1) & mask;
+		if(table[h] < 0) {
+			table[h] = vertices.size();
+			vertices.push_back(v);
+		}
+		indices[i] = table[h];
+	}
+
+	std::vector<Run> runs;
+	for(quint32 i = 0; i < n; i++) {
+		const Triangle &t = triangles[i];
+		if(runs.size() && runs.back().node == t.node && runs.back().tex == t.tex)
+			runs.back().count++;
+		else
+			runs.push_back(Run{ t.node, t.tex, 1 });
+	}
+
+	Header header;
+	header.ntriangles = n;
+	header.nvertices = vertices.size();
+	header.nruns = runs.size();
+	header.index_size = vertices.size() <= (1<<16) ? 2 : 4;
+
+	quint64 size = sizeof(Header) + vertices.size()*sizeof(Vertex) + runs.size()*sizeof(Run) + n*3*header.index_size;
+	buffer.resize(size);
+	uchar *data = buffer.data();
+	memcpy(data, &header, sizeof(Header));
+	data += sizeof(Header);
+	memcpy(data, vertices.data(), vertices.size()*sizeof(Vertex));
+	data += vertices.size()*sizeof(Vertex);
+	memcpy(data, runs.data(), runs.size()*sizeof(Run));
+	data += runs.size()*sizeof(Run);
+	if(header.index_size == 2) {
+		quint16 *short_indices = (quint16 *)data;
+		for(quint32 i = 0; i < n*3; i++)
+			short_indices[i] = indices[i];
+	} else
+		memcpy(data, indices.data(), n*3*sizeof(quint32));
+	return size;
+}
+
+quint32 PackedSoup::decode(const uchar *buffer, std::vector<Triangle> &triangles) {
+	Header header;
+	memcpy(&header, buffer, sizeof(Header));
+	const Vertex *vertices = (const Vertex *)(buffer + sizeof(Header));
+	const Run *runs = (const Run *)(vertices + header.nvertices);
+	const uchar *indices = (const uchar *)(runs + header.nruns);
+
+	quint32 n = header.ntriangles;
+	triangles.resize(n);
+	for(quint32 i = 0; i < n*3; i++) {
+		quint32 index = (header.index_size == 2) ? ((const quint16 *)indices)[i] : ((const quint32 *)indices)[i];
+		triangles[i/3].vertices[i%3] = vertices[index];
+	}
+	quint32 t = 0;
+	for(quint32 r = 0; r < header.nruns; r++) {
+		for(quint32 k = 0; k < runs[r].count; k++, t++) {
+			triangles[t].node = runs[r].node;
+			triangles[t].tex = runs[r].tex;
+		}
+	}
+	return n;
+}
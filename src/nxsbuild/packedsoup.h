@@ -0,0 +1,49 @@
+/*
+Nexus
+
+Copyright(C) 2012 - Federico Ponchio
+ISTI - Italian National Research Council - Visual Computing Lab
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
+for more details.
+*/
+#ifndef NX_PACKEDSOUP_H
+#define NX_PACKEDSOUP_H
+
+#include <vector>
+#include "trianglesoup.h"
+
+/* lossless indexed encoding of a block of triangles, used by the compact StreamSoup:
+   each distinct vertex (position, color and texture coordinates) is stored once,
+   triangles as 16 bit indices (32 if the block has more than 65536 vertices), node and tex as runs.
+   Positions are not quantized: coincident vertices must stay bitwise equal across blocks. */
+
+class PackedSoup {
+public:
+	struct Header {
+		quint32 ntriangles;
+		quint32 nvertices;
+		quint32 nruns;
+		quint32 index_size;
+	};
+	struct Run {
+		quint32 node;
+		qint32 tex;
+		quint32 count;
+	};
+
+	//returns the size of the encoded block in buffer.
+	static quint64 encode(const Triangle *triangles, quint32 n, std::vector<uchar> &buffer);
+	//returns the number of triangles.
+	static quint32 decode(const uchar *buffer, std::vector<Triangle> &triangles);
+};
+
+#endif // NX_PACKEDSOUP_H
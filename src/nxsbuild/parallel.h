@@ -0,0 +1,107 @@
+/*
+Nexus
+
+Copyright(C) 2012 - Federico Ponchio
+ISTI - Italian National Research Council - Visual Computing Lab
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
+for more details.
+*/
+#ifndef NX_PARALLEL_H
+#define NX_PARALLEL_H
+
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QMutex>
+
+#include <exception>
+#include <vector>
+#include <algorithm>
+
+/* splits [begin, end) in at most n_threads contiguous ranges and calls f(start, end) on each of them,
+   the last range is processed by the calling thread. Exceptions thrown by f are rethrown here.
+   Ranges smaller than min_range are not worth a thread.
+   Threads come from a pool shared by all the calls: when it is busy (nested or concurrent calls)
+   the ranges left run on the calling thread, so a call never waits for a thread. */
+
+//grows to the largest number of threads requested.
+inline QThreadPool &rangePool(int n_threads) {
+	static QThreadPool pool;
+	static QMutex mutex;
+	QMutexLocker locker(&mutex);
+	if(pool.maxThreadCount() < n_threads)
+		pool.setMaxThreadCount(n_threads);
+	return pool;
+}
+
+template <class F> class RangeTask: public QRunnable {
+public:
+	F &f;
+	qint64 start, end;
+	std::exception_ptr &error;
+	QSemaphore *done;
+
+	RangeTask(F &_f, qint64 s, qint64 e, std::exception_ptr &err, QSemaphore *d = nullptr):
+		f(_f), start(s), end(e), error(err), done(d) {}
+	void run() {
+		try {
+			f(start, end);
+		} catch(...) {
+			error = std::current_exception();
+		}
+		if(done)
+			done->release();
+	}
+};
+
+template <class F> void parallelFor(qint64 begin, qint64 end, int n_threads, F f, qint64 min_range = 1024) {
+	qint64 n = end - begin;
+	if(n <= 0) return;
+
+	qint64 n_ranges = std::min<qint64>(n_threads, (n + min_range - 1)/min_range);
+	if(n_ranges <= 1) {
+		f(begin, end);
+		return;
+	}
+
+	qint64 step = (n + n_ranges - 1)/n_ranges;
+	n_ranges = (n + step - 1)/step;
+
+	std::vector<std::exception_ptr> errors(n_ranges);
+	QThreadPool &pool = rangePool(n_threads - 1);
+	QSemaphore done;
+	int started = 0;
+
+	std::vector<qint64> inline_ranges;
+	for(qint64 i = 0; i < n_ranges - 1; i++) {
+		qint64 start = begin + i*step;
+		RangeTask<F> *task = new RangeTask<F>(f, start, std::min(start + step, end), errors[i], &done);
+		if(pool.tryStart(task))
+			started++;
+		else {
+			delete task;
+			inline_ranges.push_back(i);
+		}
+	}
+	inline_ranges.push_back(n_ranges - 1);
+	for(qint64 i: inline_ranges) {
+		qint64 start = begin + i*step;
+		RangeTask<F>(f, start, std::min(start + step, end), errors[i]).run();
+	}
+	done.acquire(started);
+
+	for(std::exception_ptr &error: errors)
+		if(error)
+			std::rethrow_exception(error);
+}
+
+#endif // NX_PARALLEL_H
@@ -16,7 +16,11 @@ GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
 for more details.
 */
 #include "plyloader.h"
+#include "parallel.h"
 #include <math.h>
+#include <string.h>
+
+#include <QMutex>
 using namespace vcg;
 using namespace vcg::ply;
 
@@ -152,9 +156,14 @@ PlyLoader::PlyLoader(QString filename):
 		sanitizeTextureFilepath(tex.filename);
 		resolveTextureFilepath(filename, tex.filename);
 	}
+	fast = initFast(filename);
+	if(!fast)
+		file.close();
 }
 
 PlyLoader::~PlyLoader() {
+	if(data)
+		file.unmap(data);
 	pf.Destroy();
 }
 
@@ -239,6 +248,34 @@ void PlyLoader::init() {
 	pf.SetCurElement(vertices_element);
 }
 
+void PlyLoader::convertVertex(PlyVertex &vertex, Vertex &v) {
+	if(double_coords) {
+		v.v[0] = (float)(vertex.dv[0] - origin[0])*scale[0];
+		v.v[1] = (float)(vertex.dv[1] - origin[1])*scale[1];
+		v.v[2] = (float)(vertex.dv[2] - origin[2])*scale[2];
+	} else {
+		v.v[0] = (float)(vertex.v[0] - origin[0])*scale[0];
+		v.v[1] = (float)(vertex.v[1] - origin[1])*scale[1];
+		v.v[2] = (float)(vertex.v[2] - origin[2])*scale[2];
+	}
+	if(has_colors) {
+		v.c[0] = vertex.c[0];
+		v.c[1] = vertex.c[1];
+		v.c[2] = vertex.c[2];
+		v.c[3] = vertex.c[3];
+	}
+	if(has_textures) {
+		v.t[0] = vertex.t[0];
+		v.t[1] = vertex.t[1];
+	}
+
+	if(quantization) {
+		quantize(v.v[0]);
+		quantize(v.v[1]);
+		quantize(v.v[2]);
+	}
+}
+
 void PlyLoader::cacheVertices() {
 	vertices.setElementsPerBlock(1<<20);
 	vertices.resize(n_vertices);
@@ -246,33 +283,8 @@ void PlyLoader::cacheVertices() {
 	PlyVertex vertex;
 	//caching vertices on temporary file
 	for(quint64 i = 0; i < n_vertices; i++) {
-		Vertex &v = vertices[i];
 		pf.Read((void *)&vertex);
-		if(double_coords) {
-			v.v[0] = (float)(vertex.dv[0] - origin[0])*scale[0];
-			v.v[1] = (float)(vertex.dv[1] - origin[1])*scale[1];
-			v.v[2] = (float)(vertex.dv[2] - origin[2])*scale[2];
-		} else {
-			v.v[0] = (float)(vertex.v[0] - origin[0])*scale[0];
-			v.v[1] = (float)(vertex.v[1] - origin[1])*scale[1];
-			v.v[2] = (float)(vertex.v[2] - origin[2])*scale[2];
-		}
-		if(has_colors) {
-			v.c[0] = vertex.c[0];
-			v.c[1] = vertex.c[1];
-			v.c[2] = vertex.c[2];
-			v.c[3] = vertex.c[3];
-		}
-		if(has_textures) {
-			v.t[0] = vertex.t[0];
-			v.t[1] = vertex.t[1];
-		}
-		
-		if(quantization) {
-			quantize(v.v[0]);
-			quantize(v.v[1]);
-			quantize(v.v[2]);
-		}
+		convertVertex(vertex, vertices[i]);
 	}
 
 	pf.SetCurElement(faces_element);
@@ -282,15 +294,71 @@ void PlyLoader::setMaxMemory(quint64 max_memory) {
 	vertices.setMaxMemory(max_memory);
 }
 
+void PlyLoader::convertFace(PlyFace &face, Vertex *v, Triangle &current) {
+	for(int k = 0; k < 3; k++) {
+		Vertex &vertex = v[k];
+		if(!has_vertex_tex_coords) {
+			vertex.t[0] = face.t[k*2];
+			vertex.t[1] = face.t[k*2+1];
+		}
+
+		if (has_textures) {
+			float n;
+			if(vertex.t[0] != 1.0)
+				vertex.t[0] = modf(vertex.t[0], &n);
+			if(vertex.t[1] != 1.0)
+				vertex.t[1] = modf(vertex.t[1], &n);
+		}
+
+		current.vertices[k] = vertex;
+	}
+	//TODO! detect complicated texture coordinates
+
+	current.node = 0;
+	current.tex = face.texNumber + texOffset;
+}
+
 quint32 PlyLoader::getTriangles(quint32 size, Triangle *buffer) {
 	if(faces_element == -1)
 		throw QString("ply has no faces!");
 
-	if(current_triangle == 0)
+	if(current_triangle == 0 && !fast)
 		cacheVertices();
 
 	if(current_triangle >= n_triangles) return 0;
 
+	if(fast) {
+		quint32 n = (quint32)std::min<quint64>(size, n_triangles - current_triangle);
+		const uchar *faces = data + face_start + current_triangle*face_size;
+
+		parallelFor(0, n, n_threads, [&](qint64 start, qint64 end) {
+			PlyFace face;
+			memset(&face, 0, sizeof(PlyFace));
+			Vertex v[3];
+			for(qint64 i = start; i < end; i++) {
+				decode(faces + i*face_size, face_props, &face);
+				for(int k = 0; k < 3; k++) {
+					if(face.f[k] >= nVertices())
+						throw QString("Bad index in triangle list.");
+					fastVertex(face.f[k], v[k]);
+				}
+				convertFace(face, v, buffer[i]);
+			}
+		});
+		current_triangle += n;
+
+		//ignore degenerate triangles
+		quint32 count = 0;
+		for(quint32 i = 0; i < n; i++) {
+			if(buffer[i].isDegenerate())
+				continue;
+			if(count != i)
+				buffer[count] = buffer[i];
+			count++;
+		}
+		return count;
+	}
+
 	quint32 count = 0;
 
 	PlyFace face;
@@ -300,30 +368,14 @@ quint32 PlyLoader::getTriangles(quint32 size, Triangle *buffer) {
 		pf.Read((void *) &face);
 		Triangle &current = buffer[count];
 
+		Vertex v[3];
 		for(int k = 0; k < 3; k++) {
-			int v = face.f[k];
-			if(v < 0 || v >= nVertices())
+			int index = face.f[k];
+			if(index < 0 || index >= nVertices())
 				throw QString("Bad index in triangle list.");
-			Vertex &vertex = vertices[face.f[k]];
-			if(!has_vertex_tex_coords) {
-				vertex.t[0] = face.t[k*2];
-				vertex.t[1] = face.t[k*2+1];
-			}
-
-			if (has_textures) {
-				float n;
-				if(vertex.t[0] != 1.0)
-					vertex.t[0] = modf(vertex.t[0], &n);
-				if(vertex.t[1] != 1.0)
-					vertex.t[1] = modf(vertex.t[1], &n);
-			}
-
-			current.vertices[k] = vertex;
+			v[k] = vertices[face.f[k]];
 		}
-		//TODO! detect complicated texture coordinates
-		
-		current.node = 0;
-		current.tex = face.texNumber + texOffset;
+		convertFace(face, v, current);
 
 		current_triangle++;
 
@@ -336,14 +388,72 @@ quint32 PlyLoader::getTriangles(quint32 size, Triangle *buffer) {
 	return count;
 }
 
+void PlyLoader::convertSplat(PlyVertex &vertex, Splat &v, vcg::Box3d &box) {
+	v.node = 0;
+
+	vcg::Point3d p;
+	if(double_coords) {
+		p = vcg::Point3d(vertex.dv);
+	} else {
+		p = vcg::Point3d(vertex.v[0], vertex.v[1], vertex.v[2]);
+	}
+	p -= origin;
+	p[0] *= scale[0];
+	p[1] *= scale[1];
+	p[2] *= scale[2];
+	box.Add(p);
+	v.v[0] = (float)p[0];
+	v.v[1] = (float)p[1];
+	v.v[2] = (float)p[2];
+
+	if(has_colors) {
+		v.c[0] = vertex.c[0];
+		v.c[1] = vertex.c[1];
+		v.c[2] = vertex.c[2];
+		v.c[3] = vertex.c[3];
+	}
+	if(has_textures) {
+		v.t[0] = vertex.t[0];
+		v.t[1] = vertex.t[1];
+	}
+	if(has_normals) {
+		v.n[0] = vertex.n[0];
+		v.n[1] = vertex.n[1];
+		v.n[2] = vertex.n[2];
+	}
+
+	if(quantization) {
+		quantize(v.v[0]);
+		quantize(v.v[1]);
+		quantize(v.v[2]);
+	}
+}
+
 quint32 PlyLoader::getVertices(quint32 size, Splat *splats) {
 	if(current_triangle > n_triangles) return 0;
 
+	if(fast) {
+		quint32 n = (quint32)std::min<quint64>(size, n_vertices - current_vertex);
+		const uchar *records = data + vertex_start + current_vertex*vertex_size;
+
+		QMutex m_box;
+		parallelFor(0, n, n_threads, [&](qint64 start, qint64 end) {
+			vcg::Box3d range_box;
+			PlyVertex vertex;
+			vertex.c[3] = 255;
+			for(qint64 i = start; i < end; i++) {
+				decode(records + i*vertex_size, vertex_props, &vertex);
+				convertSplat(vertex, splats[i], range_box);
+			}
+			QMutexLocker locker(&m_box);
+			box.Add(range_box);
+		});
+		current_vertex += n;
+		return n;
+	}
+
 	PlyVertex vertex;
 	
-	Splat v;
-	v.node = 0;
-	v.c[3] = 255;
 	quint32 count = 0;
 	for(quint32 i = 0; i < size && current_vertex < n_vertices; i++) {
 
@@ -351,43 +461,222 @@ quint32 PlyLoader::getVertices(quint32 size, Splat *splats) {
 
 		Splat &v = splats[count++];
 		current_vertex++;
+		convertSplat(vertex, v, box);
+	}
+	return count;
+}
 
-		vcg::Point3d p;
-		if(double_coords) {
-			p = vcg::Point3d(vertex.dv);
-		} else {
-			p = vcg::Point3d(vertex.v[0], vertex.v[1], vertex.v[2]);
-		}
-		p -= origin;
-		p[0] *= scale[0];
-		p[1] *= scale[1];
-		p[2] *= scale[2];
-		box.Add(p);
-		v.v[0] = (float)p[0];
-		v.v[1] = (float)p[1];
-		v.v[2] = (float)p[2];
-
-		if(has_colors) {
-			v.c[0] = vertex.c[0];
-			v.c[1] = vertex.c[1];
-			v.c[2] = vertex.c[2];
-			v.c[3] = vertex.c[3];
+//FAST PATH
+
+typedef void (*PlyConverter)(const uchar *src, void *dst);
+
+template <class S, class D> static void convertType(const uchar *src, void *dst) {
+	S s;
+	memcpy(&s, src, sizeof(S)); //records are not aligned
+	*(D *)dst = (D)s;
+}
+
+template <class D> static PlyConverter converter(const QByteArray &type) {
+	if(type == "char"   || type == "int8")    return convertType<qint8, D>;
+	if(type == "uchar"  || type == "uint8")   return convertType<quint8, D>;
+	if(type == "short"  || type == "int16")   return convertType<qint16, D>;
+	if(type == "ushort" || type == "uint16")  return convertType<quint16, D>;
+	if(type == "int"    || type == "int32")   return convertType<qint32, D>;
+	if(type == "uint"   || type == "uint32")  return convertType<quint32, D>;
+	if(type == "float"  || type == "float32") return convertType<float, D>;
+	if(type == "double" || type == "float64") return convertType<double, D>;
+	return nullptr;
+}
+
+static quint32 typeSize(const QByteArray &type) {
+	if(type == "char"   || type == "int8"    || type == "uchar"  || type == "uint8")  return 1;
+	if(type == "short"  || type == "int16"   || type == "ushort" || type == "uint16") return 2;
+	if(type == "int"    || type == "int32"   || type == "uint"   || type == "uint32" ||
+	   type == "float"  || type == "float32") return 4;
+	if(type == "double" || type == "float64") return 8;
+	return 0;
+}
+
+bool PlyLoader::initFast(QString filename) {
+#if Q_BYTE_ORDER != Q_LITTLE_ENDIAN
+	return false;
+#endif
+	file.setFileName(filename);
+	if(!file.open(QFile::ReadOnly))
+		return false;
+
+	struct Element {
+		QByteArray name;
+		quint64 count;
+		std::vector<QList<QByteArray> > properties;
+	};
+	std::vector<Element> elements;
+	bool binary = false;
+	while(true) {
+		QByteArray line = file.readLine();
+		if(line.isEmpty())
+			return false;
+		QList<QByteArray> tokens = line.simplified().split(' ');
+		if(tokens[0] == "end_header")
+			break;
+
+		if(tokens[0] == "format") {
+			binary = (tokens.size() > 1 && tokens[1] == "binary_little_endian");
+
+		} else if(tokens[0] == "element" && tokens.size() == 3) {
+			Element element;
+			element.name = tokens[1];
+			element.count = tokens[2].toULongLong();
+			elements.push_back(element);
+
+		} else if(tokens[0] == "property") {
+			if(!elements.size())
+				return false;
+			elements.back().properties.push_back(tokens);
 		}
-		if(has_textures) {
-			v.t[0] = vertex.t[0];
-			v.t[1] = vertex.t[1];
+	}
+	if(!binary)
+		return false;
+
+	quint64 offset = file.pos();
+	for(Element &element: elements) {
+		bool is_vertex = (element.name == "vertex");
+		bool is_face = (element.name == "face");
+		std::vector<FastProperty> &props = is_vertex? vertex_props : face_props;
+
+		bool plain_colors = false;
+		for(auto &tokens: element.properties)
+			if(tokens.size() == 3 && tokens[2] == "red")
+				plain_colors = true;
+
+		quint32 record = 0;
+		for(auto &tokens: element.properties) {
+			FastProperty p;
+			p.offset = record;
+			p.stride = 0;
+			p.count = 0;
+			p.count_size = 0;
+			p.convert = nullptr;
+			p.convert_count = nullptr;
+
+			if(tokens.size() == 5 && tokens[1] == "list") {
+				if(!is_face)
+					return false;
+				QByteArray &name = tokens[4];
+				if(name == "vertex_indices" || name == "vertex_index") {
+					p.count = 3;
+					p.target = offsetof(PlyFace, f[0]);
+					p.stride = sizeof(quint32);
+					p.convert = converter<quint32>(tokens[3]);
+
+				} else if(name == "texcoord") {
+					p.count = 6;
+					p.target = offsetof(PlyFace, t[0]);
+					p.stride = sizeof(float);
+					p.convert = converter<float>(tokens[3]);
+
+				} else //unknown length.
+					return false;
+
+				p.count_size = typeSize(tokens[2]);
+				p.convert_count = converter<quint32>(tokens[2]);
+				p.size = typeSize(tokens[3]);
+				if(!p.count_size || !p.size)
+					return false;
+				record += p.count_size + p.count*p.size;
+				props.push_back(p);
+				continue;
+			}
+
+			if(tokens.size() != 3)
+				return false;
+			p.size = typeSize(tokens[1]);
+			if(!p.size)
+				return false;
+			record += p.size;
+
+			QByteArray &name = tokens[2];
+			QByteArray &type = tokens[1];
+			if(is_vertex) {
+				const char *coords[3] = { "x", "y", "z" };
+				const char *colors[4] = { "red", "green", "blue", "alpha" };
+				const char *diffuse[3] = { "diffuse_red", "diffuse_green", "diffuse_blue" };
+				const char *normals[3] = { "nx", "ny", "nz" };
+				const char *texcoords[2] = { "s", "t" };
+				for(int k = 0; k < 3; k++) {
+					if(name != coords[k]) continue;
+					if(double_coords) {
+						p.target = offsetof(PlyVertex, dv[0]) + k*sizeof(double);
+						p.convert = converter<double>(type);
+					} else {
+						p.target = offsetof(PlyVertex, v[0]) + k*sizeof(float);
+						p.convert = converter<float>(type);
+					}
+				}
+				for(int k = 0; k < 4 && has_colors; k++) {
+					if(name != colors[k] && (plain_colors || k == 3 || name != diffuse[k])) continue;
+					p.target = offsetof(PlyVertex, c[0]) + k;
+					p.convert = converter<quint8>(type);
+				}
+				for(int k = 0; k < 3 && has_normals; k++) {
+					if(name != normals[k]) continue;
+					p.target = offsetof(PlyVertex, n[0]) + k*sizeof(float);
+					p.convert = converter<float>(type);
+				}
+				for(int k = 0; k < 2 && has_vertex_tex_coords; k++) {
+					if(name != texcoords[k]) continue;
+					p.target = offsetof(PlyVertex, t[0]) + k*sizeof(float);
+					p.convert = converter<float>(type);
+				}
+
+			} else if(is_face && name == "texnumber") {
+				p.target = offsetof(PlyFace, texNumber);
+				p.convert = converter<qint32>(type);
+			}
+
+			if(p.convert)
+				props.push_back(p);
 		}
-		if(has_normals) {
-			v.n[0] = vertex.n[0];
-			v.n[1] = vertex.n[1];
-			v.n[2] = vertex.n[2];
+
+		if(is_vertex) {
+			vertex_start = offset;
+			vertex_size = record;
+		} else if(is_face) {
+			face_start = offset;
+			face_size = record;
 		}
+		offset += element.count*record;
+	}
+
+	//a list with a different length (quads for example) would change the file size.
+	if(offset != (quint64)file.size() || !vertex_size || (n_triangles && !face_size))
+		return false;
 
-		if(quantization) {
-			quantize(v.v[0]);
-			quantize(v.v[1]);
-			quantize(v.v[2]);
+	data = file.map(0, file.size());
+	return data != nullptr;
+}
+
+void PlyLoader::decode(const uchar *record, std::vector<FastProperty> &props, void *target) {
+	uchar *t = (uchar *)target;
+	for(FastProperty &p: props) {
+		const uchar *src = record + p.offset;
+		if(!p.count) {
+			p.convert(src, t + p.target);
+			continue;
 		}
+		quint32 count;
+		p.convert_count(src, &count);
+		if(count != p.count)
+			throw QString("Unexpected list length in ply face.");
+		src += p.count_size;
+		for(quint32 k = 0; k < count; k++)
+			p.convert(src + k*p.size, t + p.target + k*p.stride);
 	}
-	return count;
+}
+
+void PlyLoader::fastVertex(quint64 index, Vertex &v) {
+	PlyVertex vertex;
+	vertex.c[3] = 255;
+	decode(data + vertex_start + index*vertex_size, vertex_props, &vertex);
+	convertVertex(vertex, v);
 }
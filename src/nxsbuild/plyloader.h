@@ -24,6 +24,10 @@ for more details.
 
 #include <wrap/ply/plylib.h>
 
+#include <QFile>
+
+struct PlyVertex;
+struct PlyFace;
 
 class PlyLoader: public MeshLoader {
 public:
@@ -51,6 +55,33 @@ private:
 
 	void init();
 	void cacheVertices();
+	void convertVertex(PlyVertex &vertex, Vertex &v);
+	void convertSplat(PlyVertex &vertex, Splat &v, vcg::Box3d &box);
+	void convertFace(PlyFace &face, Vertex *v, Triangle &triangle);
+
+	//fast path for binary little endian ply where every element has a fixed size:
+	//the file is mapped and records are decoded in parallel, vertices are read directly from the file.
+	struct FastProperty {
+		quint32 offset;                              //in the record
+		quint32 size;                                //of the (item) type in the file
+		void (*convert)(const uchar *src, void *dst);
+		quint32 target;                              //offset in PlyVertex or PlyFace
+		quint32 stride;                              //between list items in the target
+		quint32 count;                               //expected list length, 0 if not a list
+		quint32 count_size;                          //of the list length type
+		void (*convert_count)(const uchar *src, void *dst);
+	};
+	bool fast = false;
+	QFile file;
+	uchar *data = nullptr;
+	quint64 vertex_start = 0, vertex_size = 0;
+	quint64 face_start = 0, face_size = 0;
+	std::vector<FastProperty> vertex_props;
+	std::vector<FastProperty> face_props;
+
+	bool initFast(QString filename);
+	void decode(const uchar *record, std::vector<FastProperty> &props, void *target);
+	void fastVertex(quint64 index, Vertex &v);
 };
 
 #endif // NX_PLYLOADER_H
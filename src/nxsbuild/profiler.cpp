@@ -0,0 +1,178 @@
+/*
+Nexus
+
+Copyright(C) 2012 - Federico Ponchio
+ISTI - Italian National Research Council - Visual Computing Lab
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
+for more details.
+*/
+#include "profiler.h"
+
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <QFile>
+#include <QTextStream>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <time.h>
+#endif
+
+bool Profiler::active = false;
+
+namespace {
+
+struct PhaseStats {
+	quint64 count = 0;
+	qint64 wall = 0;
+	qint64 cpu = 0;
+	qint64 max = 0;
+	quint64 bytes = 0;
+};
+
+struct LockStats {
+	quint64 contended = 0;
+	qint64 wait = 0;
+	qint64 max = 0;
+};
+
+struct Event {
+	const char *name;
+	bool lock;
+	int thread;
+	qint64 start;
+	qint64 duration;
+	quint64 bytes;
+};
+
+QElapsedTimer timer;
+QMutex m_profiler;
+std::map<std::string, PhaseStats> phases;
+std::map<std::string, LockStats> locks;
+std::vector<Event> events;
+quint64 dropped = 0;
+
+const size_t max_events = 1<<20;    //keep the trace loadable
+const qint64 min_lock_event = 100;  //lock waits shorter than this (us) are not traced
+
+int threadIndex() {
+	static QAtomicInt counter;
+	thread_local int index = -1;
+	if(index < 0)
+		index = counter.fetchAndAddRelaxed(1);
+	return index;
+}
+
+void addEvent(const Event &e) {
+	if(events.size() < max_events)
+		events.push_back(e);
+	else
+		dropped++;
+}
+
+}
+
+void Profiler::enable() {
+	timer.start();
+	active = true;
+}
+
+qint64 Profiler::now() {
+	return timer.nsecsElapsed()/1000;
+}
+
+qint64 Profiler::threadCpu() {
+#ifndef WIN32
+	struct timespec ts;
+	if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+		return ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+#endif
+	return 0;
+}
+
+void Profiler::addPhase(const char *name, qint64 start, qint64 wall, qint64 cpu, quint64 bytes) {
+	int thread = threadIndex();
+	QMutexLocker locker(&m_profiler);
+	PhaseStats &stats = phases[name];
+	stats.count++;
+	stats.wall += wall;
+	stats.cpu += cpu;
+	stats.bytes += bytes;
+	stats.max = std::max(stats.max, wall);
+	addEvent(Event{ name, false, thread, start, wall, bytes });
+}
+
+void Profiler::addLockWait(const char *name, qint64 start, qint64 wait) {
+	int thread = threadIndex();
+	QMutexLocker locker(&m_profiler);
+	LockStats &stats = locks[name];
+	stats.contended++;
+	stats.wait += wait;
+	stats.max = std::max(stats.max, wait);
+	if(wait >= min_lock_event)
+		addEvent(Event{ name, true, thread, start, wait, 0 });
+}
+
+void Profiler::save(QString json, QString trace) {
+	QMutexLocker locker(&m_profiler);
+	qint64 total = now();
+
+	QFile file(json);
+	if(!file.open(QFile::WriteOnly | QFile::Truncate))
+		throw QString("could not write profile %1: %2").arg(json).arg(file.errorString());
+	QTextStream out(&file);
+	out << "{\n  \"wall_ms\": " << total/1000.0 << ",\n  \"phases\": {";
+	bool first = true;
+	for(auto &p: phases) {
+		PhaseStats &s = p.second;
+		double seconds = s.wall/1e6;
+		out << (first ? "\n" : ",\n") << "    \"" << p.first.c_str() << "\": { "
+			<< "\"count\": " << s.count
+			<< ", \"wall_ms\": " << s.wall/1000.0
+			<< ", \"cpu_ms\": " << s.cpu/1000.0
+			<< ", \"max_ms\": " << s.max/1000.0
+			<< ", \"bytes\": " << s.bytes
+			<< ", \"MB_per_s\": " << (seconds > 0 ? s.bytes/(double)(1<<20)/seconds : 0.0) << " }";
+		first = false;
+	}
+	out << "\n  },\n  \"locks\": {";
+	first = true;
+	for(auto &l: locks) {
+		LockStats &s = l.second;
+		out << (first ? "\n" : ",\n") << "    \"" << l.first.c_str() << "\": { "
+			<< "\"contended\": " << s.contended
+			<< ", \"wait_ms\": " << s.wait/1000.0
+			<< ", \"max_ms\": " << s.max/1000.0 << " }";
+		first = false;
+	}
+	out << "\n  },\n  \"dropped_events\": " << dropped << "\n}\n";
+
+	QFile tracefile(trace);
+	if(!tracefile.open(QFile::WriteOnly | QFile::Truncate))
+		throw QString("could not write trace %1: %2").arg(trace).arg(tracefile.errorString());
+	QTextStream tout(&tracefile);
+	tout << "{ \"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	for(size_t i = 0; i < events.size(); i++) {
+		Event &e = events[i];
+		tout << "{ \"name\": \"" << e.name << "\", \"cat\": \"" << (e.lock ? "lock" : "phase")
+			 << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.thread
+			 << ", \"ts\": " << e.start << ", \"dur\": " << e.duration;
+		if(e.bytes)
+			tout << ", \"args\": { \"bytes\": " << e.bytes << " }";
+		tout << " }" << (i + 1 < events.size() ? ",\n" : "\n");
+	}
+	tout << "] }\n";
+}
@@ -0,0 +1,90 @@
+/*
+Nexus
+
+Copyright(C) 2012 - Federico Ponchio
+ISTI - Italian National Research Council - Visual Computing Lab
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License (http://www.gnu.org/licenses/gpl.txt)
+for more details.
+*/
+#ifndef NX_PROFILER_H
+#define NX_PROFILER_H
+
+#include <QString>
+#include <QMutex>
+
+/* Build phase instrumentation: wall and thread cpu time, bytes moved and time spent waiting on locks.
+   Disabled by default, when disabled scopes and lockers cost a branch.
+   Phase and lock names must be string literals (pointers are stored). */
+
+class Profiler {
+public:
+	static void enable();
+	static bool enabled() { return active; }
+
+	static qint64 now();         //microseconds since enable
+	static qint64 threadCpu();   //microseconds of cpu used by the calling thread
+
+	static void addPhase(const char *name, qint64 start, qint64 wall, qint64 cpu, quint64 bytes);
+	static void addLockWait(const char *name, qint64 start, qint64 wait);
+
+	//json summary and chrome trace (load it in chrome://tracing or ui.perfetto.dev)
+	static void save(QString json, QString trace);
+
+private:
+	static bool active;
+};
+
+//times the enclosing scope
+class ProfileScope {
+public:
+	ProfileScope(const char *_name, quint64 _bytes = 0): name(_name), bytes(_bytes) {
+		if(!Profiler::enabled()) return;
+		start = Profiler::now();
+		cpu = Profiler::threadCpu();
+	}
+	~ProfileScope() {
+		if(!Profiler::enabled()) return;
+		Profiler::addPhase(name, start, Profiler::now() - start, Profiler::threadCpu() - cpu, bytes);
+	}
+	void addBytes(quint64 b) { bytes += b; }
+
+private:
+	const char *name;
+	quint64 bytes;
+	qint64 start = 0;
+	qint64 cpu = 0;
+};
+
+//QMutexLocker recording how long it waited for the lock
+class ProfileLocker {
+public:
+	ProfileLocker(QMutex *m, const char *name): mutex(m) {
+		if(!Profiler::enabled()) {
+			mutex->lock();
+			return;
+		}
+		if(mutex->tryLock())
+			return;
+		qint64 start = Profiler::now();
+		mutex->lock();
+		Profiler::addLockWait(name, start, Profiler::now() - start);
+	}
+	~ProfileLocker() { mutex->unlock(); }
+
+private:
+	QMutex *mutex;
+
+	ProfileLocker(const ProfileLocker &);
+	ProfileLocker &operator=(const ProfileLocker &);
+};
+
+#endif // NX_PROFILER_H
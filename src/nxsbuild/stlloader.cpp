@@ -1,9 +1,31 @@
 #include "stlloader.h"
+#include "parallel.h"
 
+#include <string.h>
 #include <iostream>
 using namespace std;
 
-STLLoader::STLLoader(QString filename) {
+static const qint64 chunk_size = 1<<23;
+
+//position of the next "endfacet" or -1
+static qint64 findEndFacet(const char *data, qint64 pos, qint64 size) {
+	while(pos < size) {
+		const char *e = (const char *)memchr(data + pos, 'e', size - pos);
+		if(!e)
+			return -1;
+		pos = e - data;
+		if(size - pos >= 8 && strncmp(e, "endfacet", 8) == 0)
+			return pos;
+		pos++;
+	}
+	return -1;
+}
+
+STLLoader::STLLoader(QString filename):
+	n_vertices(0),
+	n_triangles(0),
+	current_triangle(0),
+	current_vertex(0) {
 
 	has_colors = has_normals = has_textures = false;
 
@@ -15,16 +37,55 @@ STLLoader::STLLoader(QString filename) {
 	if(header.size() != 5)
 		throw QString("Unexpected end of file");
 	ascii = header.startsWith("solid");
+
+	//some exporters write binary files starting with "solid": trust the size if it matches the face count.
+	quint32 count = 0;
+	if(ascii && file.size() >= 84) {
+		file.seek(80);
+		file.read((char *)&count, 4);
+		if(84 + 50*(quint64)count == (quint64)file.size())
+			ascii = false;
+		file.seek(0);
+	}
+
 	if(ascii) {
 		file.readLine();
 		n_triangles = 0;
-		return;
+	} else {
+		if(file.size() < 84)
+			throw QString("Unexpected end of file");
+		header = file.read(80); //ignored
+		if(header.size() != 80 || file.read((char *)&count, 4) != 4) //TODO support little endian in big-endiam systems
+			throw QString("Unexpected end of file");
+		n_triangles = count;
 	}
-	header = file.read(80); //ignored
-	file.read((char *)&n_triangles, 4); //TODO support little endian in big-endiam systems
 
+	if(file.size() > 0)
+		data = file.map(0, file.size());
+	if(!data || !ascii)
+		return;
+
+	//split in chunks of whole facets.
+	qint64 size = file.size();
+	chunks.push_back(0);
+	for(qint64 pos = chunk_size; pos < size; pos += chunk_size) {
+		pos = findEndFacet((const char *)data, pos, size);
+		if(pos < 0)
+			break;
+		const char *nl = (const char *)memchr(data + pos, '\n', size - pos);
+		if(!nl)
+			break;
+		pos = nl - (const char *)data + 1;
+		chunks.push_back(pos);
+	}
+	if(chunks.back() != size)
+		chunks.push_back(size);
 }
 
+STLLoader::~STLLoader() {
+	if(data)
+		file.unmap(data);
+}
 
 /*
 facet normal nx ny nz
@@ -64,7 +125,7 @@ quint32 STLLoader::getTrianglesAscii(quint32 size, Triangle *buffer) {
 			d -= origin;
 			d[0] *= scale[0];
 			d[1] *= scale[1];
-			d[0] *= scale[2];
+			d[2] *= scale[2];
 			box.Add(d);
 					
 			v[0] = (float)(d[0]);
@@ -108,6 +169,103 @@ quint32 STLLoader::getTrianglesBinary(quint32 size, Triangle *buffer) {
 	return nread;
 }
 
+quint32 STLLoader::getTrianglesMapped(quint32 size, Triangle *buffer) {
+	//a truncated file has less records than declared.
+	quint64 total = std::min<quint64>(n_triangles, (file.size() - 84)/50);
+	if(current_triangle >= total)
+		return 0;
+
+	quint32 n = (quint32)std::min<quint64>(size, total - current_triangle);
+	const uchar *records = data + 84 + current_triangle*50;
+	parallelFor(0, n, n_threads, [&](qint64 start, qint64 end) {
+		float pos[9];
+		for(qint64 i = start; i < end; i++) {
+			memcpy(pos, records + i*50 + 12, 36); //skip normal, records are not aligned
+			Triangle &tri = buffer[i];
+			for(int t = 0; t < 3; t++)
+				for(int k = 0; k < 3; k++)
+					tri.vertices[t].v[k] = (pos[t*3 + k] - origin[k])*scale[k];
+			tri.node = 0;
+		}
+	});
+	current_triangle += n;
+	return n;
+}
+
+void STLLoader::parseAscii(qint64 start, qint64 end, std::vector<Triangle> &triangles, vcg::Box3d &box) {
+	const char *p = (const char *)data + start;
+	const char *chunk_end = (const char *)data + end;
+
+	Triangle tri = Triangle();
+	tri.node = 0;
+	int corner = 0;
+	while(p < chunk_end) {
+		const char *nl = (const char *)memchr(p, '\n', chunk_end - p);
+		const char *le = nl ? nl : chunk_end;
+		const char *q = p;
+		p = le + 1;
+
+		while(q < le && (*q == ' ' || *q == '\t'))
+			q++;
+		if(le - q < 7 || strncmp(q, "vertex", 6) != 0 || (q[6] != ' ' && q[6] != '\t'))
+			continue;
+		q += 7;
+
+		vcg::Point3d d;
+		for(int k = 0; k < 3; k++)
+			if(!parseNumber(q, le, d[k]))
+				throw QString("Invalid STL file");
+		d -= origin;
+		d[0] *= scale[0];
+		d[1] *= scale[1];
+		d[2] *= scale[2];
+		box.Add(d);
+
+		float *v = tri.vertices[corner].v;
+		v[0] = (float)(d[0]);
+		v[1] = (float)(d[1]);
+		v[2] = (float)(d[2]);
+		if(++corner == 3) {
+			triangles.push_back(tri);
+			corner = 0;
+		}
+	}
+	if(corner != 0)
+		throw QString("Invalid STL file");
+}
+
+quint32 STLLoader::getTrianglesAsciiMapped(quint32 size, Triangle *buffer) {
+	while(pending_used == pending.size()) {
+		if(current_chunk + 1 >= chunks.size())
+			return 0;
+
+		//parse a group of chunks, one per thread.
+		quint64 group = std::min<quint64>(std::max(n_threads, 1), chunks.size() - 1 - current_chunk);
+		std::vector<std::vector<Triangle> > parsed(group);
+		std::vector<vcg::Box3d> boxes(group);
+		parallelFor(0, group, n_threads, [&](qint64 start, qint64 end) {
+			for(qint64 i = start; i < end; i++) {
+				quint64 c = current_chunk + i;
+				parseAscii(chunks[c], chunks[c+1], parsed[i], boxes[i]);
+			}
+		}, 1);
+		current_chunk += group;
+
+		pending.clear();
+		pending_used = 0;
+		for(quint64 i = 0; i < group; i++) {
+			pending.insert(pending.end(), parsed[i].begin(), parsed[i].end());
+			box.Add(boxes[i]);
+		}
+	}
+
+	quint32 count = (quint32)std::min<quint64>(size, pending.size() - pending_used);
+	std::copy(pending.begin() + pending_used, pending.begin() + pending_used + count, buffer);
+	pending_used += count;
+	current_triangle += count;
+	return count;
+}
+
 quint32 STLLoader::getVertices(quint32 /*size*/, Splat */*vertex*/) {
 	throw QString("Unimplemented!");
 }
@@ -6,9 +6,12 @@
 class STLLoader: public MeshLoader {
 public:
 	STLLoader(QString filename);
+	~STLLoader();
 
 	void setMaxMemory(quint64 /*max_memory*/) { /* ignore, here no memory needed */ }
 	quint32 getTriangles(quint32 size, Triangle *buffer) {
+		if(data)
+			return ascii ? getTrianglesAsciiMapped(size, buffer) : getTrianglesMapped(size, buffer);
 		if(ascii)
 			return getTrianglesAscii(size, buffer);
 		else
@@ -23,7 +26,18 @@ private:
 	quint32 getTrianglesAscii(quint32 size, Triangle *buffer);
 	quint32 getTrianglesBinary(quint32 size, Triangle *buffer);
 
+	//when the file can be mapped binary records are converted in parallel,
+	//ascii files are split in chunks of whole facets and tokenized in parallel.
+	quint32 getTrianglesMapped(quint32 size, Triangle *buffer);
+	quint32 getTrianglesAsciiMapped(quint32 size, Triangle *buffer);
+	void parseAscii(qint64 start, qint64 end, std::vector<Triangle> &triangles, vcg::Box3d &box);
+
 	QFile file;
+	uchar *data = nullptr;
+	std::vector<qint64> chunks; //ascii chunk boundaries
+	quint64 current_chunk = 0;
+	std::vector<Triangle> pending;
+	quint64 pending_used = 0;
 
 	bool ascii;
 	quint64 n_vertices;
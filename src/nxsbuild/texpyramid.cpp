@@ -4,7 +4,9 @@
 #include <QPainter>
 #include <QImageReader>
 #include <QDebug>
+#include <QBuffer>
 #include "texpyramid.h"
+#include "parallel.h"
 
 using namespace nx;
 using namespace std;
@@ -117,7 +119,7 @@ QImage TexLevel::read(QRect region) {
 //reading line by line and fill all the levels at the same time
 //keep 2 lines in float for averaging, for each first line of tiles of each level.
 //in qimage reader use setscaledcliprect
-void TexLevel::build(TexLevel &parent) {
+void TexLevel::setup(TexLevel &parent) {
 	int side = collection->side;
 	float scale = collection->scale;
 	tex = parent.tex;
@@ -126,23 +128,23 @@ void TexLevel::build(TexLevel &parent) {
 
 	tilew = 1 + (width-1)/side;
 	tileh = 1 + (height-1)/side;
+}
 
-	int oside = (int)(side/scale);
-
-	for(int y = 0; y < tileh; y++) {
-		for(int x = 0; x < tilew; x++) {
-			int w = (x*side + side > width)? width - x*side : side;
-			int h = (y*side + side > height)? height - y*side : side;
-			int sx = x*oside;
-			int sy = y*oside;
-			int sw = (sx + oside > parent.width) ? parent.width - sx: oside;
-			int sh = (sy + oside > parent.height) ? parent.height - sy: oside;
-			QRect region(sx, sy, sw, sh);
-			QImage img = parent.read(region);
-			img = img.scaled(w, h);
-			collection->addImg(TexAtlas::Index(tex, level, x + tilew*y), img);
-		}
-	}
+void TexLevel::buildTile(TexLevel &parent, int x, int y) {
+	int side = collection->side;
+	int oside = (int)(side/collection->scale);
+
+	int w = (x*side + side > width)? width - x*side : side;
+	int h = (y*side + side > height)? height - y*side : side;
+	int sx = x*oside;
+	int sy = y*oside;
+	int sw = (sx + oside > parent.width) ? parent.width - sx: oside;
+	int sh = (sy + oside > parent.height) ? parent.height - sy: oside;
+	QRect region(sx, sy, sw, sh);
+	QImage img = parent.read(region);
+	//smooth scaling averages the covered texels (box filter, simd in qt) instead of picking the nearest.
+	img = img.scaled(w, h, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+	collection->addImg(TexAtlas::Index(tex, level, x + tilew*y), img);
 }
 /*
 void TexLevel::build(QImage img) {
@@ -203,36 +205,38 @@ QImage TexPyramid::read(int level, QRect region) {
 	return levels[level].read(region);
 }
 
-void TexPyramid::buildLevel(int level) {
-	if(levels.size() > (size_t)level) return;
+bool TexPyramid::buildLevel(int level) {
+	if(levels.size() > (size_t)level) return false;
 	if(levels.size() != (size_t)level)
 		throw QString("texture atlas cannot skip levels when building");
 	levels.resize(level + 1);
 	TexLevel &texlevel = levels.back();
 	texlevel.level = level;
 	texlevel.collection = collection;
-	texlevel.build(levels[level-1]);
+	texlevel.setup(levels[level-1]);
+	return true;
 }
 
 
 
 void TexAtlas::addTextures(std::vector<QImage>& textures) {
 	pyramids.resize(textures.size());
-	for(size_t i = 0; i < pyramids.size(); i++) {
-		TexPyramid &py = pyramids[i];
-		py.init(i, this, textures[i]);
-	}
+	parallelFor(0, pyramids.size(), n_threads, [&](qint64 start, qint64 end) {
+		for(qint64 i = start; i < end; i++)
+			pyramids[i].init(i, this, textures[i]);
+	}, 1);
 }
 
 bool TexAtlas::addTextures(std::vector<LoadTexture> &textures) {
 	pyramids.resize(textures.size());
-	for(size_t i = 0; i < pyramids.size(); i++) {
-		TexPyramid &py = pyramids[i];
-		bool ok = py.init(i, this, textures[i]);
-		if(!ok) {
-			throw ("could not load texture: " + textures[i].filename);
+	parallelFor(0, pyramids.size(), n_threads, [&](qint64 start, qint64 end) {
+		for(qint64 i = start; i < end; i++) {
+			bool ok = pyramids[i].init(i, this, textures[i]);
+			if(!ok) {
+				throw ("could not load texture: " + textures[i].filename);
+			}
 		}
-	}
+	}, 1);
 	return true;
 }
 
@@ -240,27 +244,76 @@ QImage TexAtlas::read(int tex, int level, QRect region) {
 	return pyramids[tex].read(level, region);
 }
 
+void TexAtlas::touch(Index index, Tile &tile) {
+	if(tile.cached) {
+		lru.splice(lru.begin(), lru, tile.lru);
+		return;
+	}
+	lru.push_front(index);
+	tile.lru = lru.begin();
+	tile.cached = true;
+	cache_size += imageSize(tile.image);
+}
+
 void TexAtlas::addImg(Index index, QImage img) {
 	//cout << "Adding: tex: " << index.tex << " level: " << index.level << " index: " << index.index << endl;
-	cache_size += img.width()*img.height()*4;
-	ram[index] = RamData(img, access++);
+	{
+		QMutexLocker locker(&m_cache);
+		Tile &tile = tiles[index];
+		if(tile.cached) {
+			cache_size -= imageSize(tile.image);
+			lru.erase(tile.lru);
+			tile.cached = false;
+		}
+		tile.image = img;
+		tile.on_disk = false;
+		touch(index, tile);
+	}
 	pruneCache();
 }
 
 QImage TexAtlas::getImg(Index index) {
-	auto it = ram.find(index);
-	if(it != ram.end())
-		return it->second.image;
-
-	auto dt = disk.find(index);
-	if(dt == disk.end())
-		throw QString("unespected missing image in disk and ram");
-
-	QImage img(dt->second.w, dt->second.h, QImage::Format_RGB32);
-	uchar *data = storage.map(dt->second.offset, dt->second.size);
-	img.loadFromData(data, dt->second.size);
-	storage.unmap(data);
-	addImg(index, img);
+	Tile *tile = nullptr;
+	{
+		QMutexLocker locker(&m_cache);
+		auto it = tiles.find(index);
+		if(it == tiles.end())
+			throw QString("unespected missing image in disk and ram");
+		tile = &it->second;
+		if(!tile->image.isNull()) {
+			touch(index, *tile);
+			return tile->image;
+		}
+	}
+
+	//decode outside of the cache lock, threads needing the same tile wait here.
+	QMutexLocker loading(&tile->loading);
+	DiskData d;
+	{
+		QMutexLocker locker(&m_cache);
+		if(!tile->image.isNull()) { //loaded while waiting
+			touch(index, *tile);
+			return tile->image;
+		}
+		if(!tile->on_disk)
+			throw QString("unespected missing image in disk and ram");
+		d = tile->disk;
+	}
+
+	QByteArray data;
+	{
+		QMutexLocker locker(&m_storage);
+		storage.seek(d.offset);
+		data = storage.read(d.size);
+	}
+	QImage img(d.w, d.h, QImage::Format_RGB32);
+	img.loadFromData(data, "jpg");
+	{
+		QMutexLocker locker(&m_cache);
+		tile->image = img;
+		touch(index, *tile);
+	}
+	pruneCache();
 	return img;
 }
 
@@ -268,44 +321,85 @@ QImage TexAtlas::getImg(Index index) {
 
 void TexAtlas::buildLevel(int level) {
 	if(!pyramids.size()) return;
-	for(auto &py: pyramids)
-		py.buildLevel(level);
+
+	struct Job { int tex, x, y; };
+	std::vector<Job> jobs;
+	for(size_t i = 0; i < pyramids.size(); i++) {
+		TexPyramid &py = pyramids[i];
+		if(!py.buildLevel(level))
+			continue;
+		TexLevel &texlevel = py.levels[level];
+		for(int y = 0; y < texlevel.tileh; y++)
+			for(int x = 0; x < texlevel.tilew; x++)
+				jobs.push_back(Job{ (int)i, x, y });
+	}
+	//tiles are independent: the parent level is read through the cache.
+	parallelFor(0, jobs.size(), n_threads, [&](qint64 start, qint64 end) {
+		for(qint64 i = start; i < end; i++) {
+			Job &job = jobs[i];
+			std::vector<TexLevel> &levels = pyramids[job.tex].levels;
+			levels[level].buildTile(levels[level-1], job.x, job.y);
+		}
+	}, 1);
 }
 
 //do not store it in temporary file, we are throwing away this level.
 void TexAtlas::flush(int level) {
-	for (auto it = ram.cbegin(); it != ram.cend();) {
+	QMutexLocker locker(&m_cache);
+	for (auto it = tiles.begin(); it != tiles.end();) {
 		if (it->first.level == level) {
-			cache_size -= 4*(it->second.image.width())*(it->second.image.height());
-			it = ram.erase(it);
+			if(it->second.cached) {
+				cache_size -= imageSize(it->second.image);
+				lru.erase(it->second.lru);
+			}
+			it = tiles.erase(it);
 		} else
 			++it;
 	}
 }
 
 void TexAtlas::pruneCache() {
-	while(cache_size > cache_max) {
-		Index index;
-		uint32_t oldest = access;
-		for (auto it = ram.cbegin(); it != ram.cend(); it++) {
-			if(it->second.access < oldest) {
-				index = it->first;
-				oldest = it->second.access;
-			}
+	std::vector<std::pair<Index, QImage>> evicted; //not yet on disk
+	{
+		QMutexLocker locker(&m_cache);
+		while(cache_size > cache_max && lru.size()) {
+			Index index = lru.back();
+			lru.pop_back();
+			Tile &tile = tiles[index];
+			tile.cached = false;
+			cache_size -= imageSize(tile.image);
+			if(tile.on_disk)
+				tile.image = QImage();
+			else
+				evicted.push_back(std::make_pair(index, tile.image)); //stays readable until saved
 		}
-		auto it = ram.find(index);
-		cache_size -= 4*(it->second.image.width())*(it->second.image.height());
-		if(disk.find(index) == disk.end()) {
-			DiskData d;
-			d.offset = storage.pos();
-			d.w = it->second.image.width();
-			d.h = it->second.image.height();
-			it->second.image.save(&storage, "jpg", quality);
-			d.size = storage.pos() - d.offset;
-			disk[index] = d;
-		}
-		ram.erase(it);
 	}
-}
 
+	for(auto &e: evicted) {
+		QByteArray jpg;
+		QBuffer buffer(&jpg);
+		buffer.open(QIODevice::WriteOnly);
+		e.second.save(&buffer, "jpg", quality);
+
+		DiskData d;
+		d.w = e.second.width();
+		d.h = e.second.height();
+		d.size = jpg.size();
+		{
+			QMutexLocker locker(&m_storage);
+			if(!storage.isOpen() && !storage.open())
+				throw QString("could not create texture cache file: %1").arg(storage.errorString());
+			d.offset = storage.size();
+			storage.seek(d.offset);
+			if(storage.write(jpg) != jpg.size())
+				throw QString("failed writing texture cache: %1").arg(storage.errorString());
+		}
 
+		QMutexLocker locker(&m_cache);
+		Tile &tile = tiles[e.first];
+		tile.disk = d;
+		tile.on_disk = true;
+		if(!tile.cached) //nobody used it in the meantime
+			tile.image = QImage();
+	}
+}
@@ -5,8 +5,12 @@
 #include <QString>
 #include <QImage>
 #include <QTemporaryFile>
+#include <QMutex>
 #include "meshloader.h"
 
+#include <map>
+#include <list>
+
 namespace nx {
 
 class TexAtlas;
@@ -23,7 +27,8 @@ public:
 	void init(int tex, TexAtlas *c, QImage& texture, int _level);
 	bool init(int tex, TexAtlas *c, LoadTexture &texture, int _level);
 	QImage read(QRect region);
-	void build(TexLevel &parent);
+	void setup(TexLevel &parent);                    //size and tiles of a level scaled from parent
+	void buildTile(TexLevel &parent, int x, int y);  //thread safe
 	//void build(QImage img);
 };
 
@@ -36,7 +41,7 @@ public:
 	void init(int tex, TexAtlas *c, QImage &texture);
 	bool init(int tex, TexAtlas *c, LoadTexture &file);
 	QImage read(int level, QRect region);
-	void buildLevel(int level);
+	bool buildLevel(int level); //false if the level was already there, tiles are built by the atlas
 	void buildAllLevels(int n_levels);
 };
 
@@ -62,17 +67,20 @@ public:
 			return level == i.level && index == i.index && tex == i.tex;
 		}
 	};
-	struct RamData {
-		QImage image;
-		uint32_t access;
-		RamData() {}
-		RamData(QImage img, uint32_t a): image(img), access(a) {}
-	};
 	struct DiskData {
 		uint64_t offset;
 		uint64_t size;
 		uint32_t w,h;
 	};
+	//decoded tiles are in the lru list, evicted tiles are saved as jpg in storage.
+	struct Tile {
+		QImage image;                  //null if not in ram
+		bool cached = false;           //in the lru list
+		bool on_disk = false;
+		DiskData disk;
+		std::list<Index>::iterator lru;
+		QMutex loading;                //only one thread decodes a tile
+	};
 
 	const int side = 4096;
 	std::vector<TexPyramid> pyramids;
@@ -80,27 +88,34 @@ public:
 	int quality = 92;
 	uint64_t cache_max = 2000000000;
 	uint64_t cache_size = 0;
-	uint64_t access = 1;
+	int n_threads = 1;            //used to build textures and levels
 
 	TexAtlas() {}
 
 	void addTextures(std::vector<QImage>& textures);
 	//will actually fill width and height information
 	bool addTextures(std::vector<LoadTexture> &filenames);
+	//thread safe
 	QImage read(int tex, int level, QRect region);
 	void buildLevel(int level);
 
 	int width(int tex, int level) { return pyramids[tex].levels[level].width; }
 	int height(int tex, int level) { return pyramids[tex].levels[level].height; }
-	void flush(int level);
+	void flush(int level);        //not thread safe
 	void pruneCache();
 	void addImg(Index index, QImage img);
 	QImage getImg(Index index);
 
-	std::map<Index, RamData> ram;
-	std::map<Index, DiskData> disk;
+protected:
+	std::map<Index, Tile> tiles;  //tiles never move in a map
+	std::list<Index> lru;         //most recent in front
+	QMutex m_cache;               //tiles, lru and cache_size
+	QMutex m_storage;
 
 	QTemporaryFile storage;
+
+	static uint64_t imageSize(const QImage &img) { return 4*(uint64_t)img.width()*img.height(); }
+	void touch(Index index, Tile &tile); //with m_cache locked
 };
 
 } //namespace
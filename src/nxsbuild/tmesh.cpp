@@ -185,6 +185,7 @@ void TMesh::getVertices(Splat *vertices, quint32 node) {
 }
 
 float TMesh::simplify(quint32 target_faces, Simplification method) {
+	assert(seam_origin.empty()); //unsplitSeams first
 
 	//lock border triangles
 	for(uint i = 0; i < face.size(); i++)
@@ -290,6 +291,8 @@ nx::Node TMesh::getNode()
 	return node;
 }
 //we have textures stored on wedge texture coordinates, we split vertices where wedges coords are different.
+//the block mesh is split in place and simplified after unsplitSeams: vertex normals computed here and the vertex
+//texture coordinates (rewritten by extractNodeTex) are only read by serialize, simplify and getTriangles use the wedges.
 void TMesh::splitSeams(nx::Signature &sig) {
 
 	if(sig.vertex.hasNormals() && sig.face.hasIndex())
@@ -300,9 +303,11 @@ void TMesh::splitSeams(nx::Signature &sig) {
 	std::vector<TVertex> new_vert(vert.size());
 	std::vector<int> new_face;
 	std::vector<int> vert_to_tex(vert.size(), -2);
+	seam_origin.clear();
 	for(auto &f: face) {
 		for(int k = 0; k < 3; k++) {
 			int index = f.V(k) - &*vert.begin();
+			int origin = index;
 
 			assert(index >= 0);
 
@@ -328,6 +333,7 @@ void TMesh::splitSeams(nx::Signature &sig) {
 					next[index] = new_index;
 					next.push_back(-1);
 					vert_to_tex.push_back(f.tex);
+					seam_origin.push_back(origin);
 					index = new_index;
 					break;
 				}
@@ -340,7 +346,7 @@ void TMesh::splitSeams(nx::Signature &sig) {
 	for(size_t i = 0; i < vert.size(); i++) {
 		assert(vert_to_tex[i] != -2);
 	}
-	vert = new_vert;
+	vert.swap(new_vert);
 	vn = vert.size();
 	for(size_t i = 0; i < new_face.size(); i+= 3) {
 		TFace &f = face[i/3];
@@ -351,6 +357,21 @@ void TMesh::splitSeams(nx::Signature &sig) {
 	}
 }
 
+void TMesh::unsplitSeams() {
+	quint32 n = vert.size() - seam_origin.size();
+	TVertex *begin = &*vert.begin();
+	for(auto &f: face) {
+		for(int k = 0; k < 3; k++) {
+			quint32 index = f.V(k) - begin;
+			if(index >= n)
+				f.V(k) = begin + seam_origin[index - n];
+		}
+	}
+	vert.resize(n); //shrinking does not move the vertices
+	vn = n;
+	seam_origin.clear();
+}
+
 quint32 TMesh::serializedSize(nx::Signature &sig) {
 	//This should take into account duplicated vertices due to texture seams.
 	//let's created the replicated vertices.
@@ -362,20 +383,31 @@ quint32 TMesh::serializedSize(nx::Signature &sig) {
 	return size;
 }
 
+/* the mesh is still simplified after this: faces (or vertices) are written sorted by node through a permutation,
+   leaving their order, which the simplification depends on, untouched. */
 void TMesh::serialize(uchar *buffer, nx::Signature &sig, std::vector<nx::Patch> &patches) {
 	assert(vn == (int)vert.size());
 	assert(fn == (int)face.size());
 
+	std::vector<quint32> forder(fn);
+	std::vector<quint32> vorder(vn);
+	for(int i = 0; i < fn; i++)
+		forder[i] = i;
+	for(int i = 0; i < vn; i++)
+		vorder[i] = i;
+
 	quint32 current_node = 0;
 	//find patches and triangle (splat) offsets
 	if(sig.face.hasIndex()) {
 		//sort face by node.
-		std::sort(face.begin(), face.end());
+		std::sort(forder.begin(), forder.end(), [&](quint32 a, quint32 b) {
+			return face[a].node < face[b].node || (face[a].node == face[b].node && a < b);
+		});
 
 		//remember triangle_offset is the END of the triangles in the patch
-		current_node = face[0].node;
+		current_node = face[forder[0]].node;
 		for(int i = 0; i < fn; i++) {
-			TFace &f = face[i];
+			TFace &f = face[forder[i]];
 			if(f.node != current_node) {
 				nx::Patch patch;
 				patch.node = current_node;
@@ -386,10 +418,12 @@ void TMesh::serialize(uchar *buffer, nx::Signature &sig, std::vector<nx::Patch>
 			}
 		}
 	} else {
-		std::sort(vert.begin(), vert.end(), TVertexNodeCompare());
-		current_node = vert[0].node;
+		std::sort(vorder.begin(), vorder.end(), [&](quint32 a, quint32 b) {
+			return vert[a].node < vert[b].node || (vert[a].node == vert[b].node && a < b);
+		});
+		current_node = vert[vorder[0]].node;
 		for(int i = 0; i < vn; i++) {
-			TVertex &v = vert[i];
+			TVertex &v = vert[vorder[i]];
 			if(v.node != current_node) {
 				nx::Patch patch;
 				patch.node = current_node;
@@ -414,14 +448,14 @@ void TMesh::serialize(uchar *buffer, nx::Signature &sig, std::vector<nx::Patch>
 
 	vcg::Point3f *c = (vcg::Point3f *)buffer;
 	for(int i = 0; i < vn; i++)
-		c[i] = vert[i].P();
+		c[i] = vert[vorder[i]].P();
 	buffer += vert.size()*sizeof(vcg::Point3f);
 
 	if(sig.vertex.hasTextures()) {
 		vcg::Point2f *tstart = (vcg::Point2f *)buffer;
 		for(int i = 0; i < vn; i++) {
 			//assert(vert[i].T().P()[0] >= 0.0 && vert[i].T().P()[0] <= 1.0);
-			tstart[i] = vert[i].T().P();
+			tstart[i] = vert[vorder[i]].T().P();
 		}
 		buffer += vert.size() * sizeof(vcg::Point2f);
 	}
@@ -429,7 +463,7 @@ void TMesh::serialize(uchar *buffer, nx::Signature &sig, std::vector<nx::Patch>
 	if(sig.vertex.hasNormals()) {
 		vcg::Point3s *nstart = (vcg::Point3s *)buffer;
 		for(int i = 0; i < vn; i++) {
-			vcg::Point3f nf = vert[i].N();
+			vcg::Point3f nf = vert[vorder[i]].N();
 			nf.Normalize();
 			vcg::Point3s &ns = nstart[i];
 			for(int k = 0; k < 3; k++)
@@ -441,13 +475,14 @@ void TMesh::serialize(uchar *buffer, nx::Signature &sig, std::vector<nx::Patch>
 	if(sig.vertex.hasColors()) {
 		vcg::Color4b *cstart = (vcg::Color4b *)buffer;
 		for(int i = 0; i < vn; i++)
-			cstart[i] = vert[i].C();
+			cstart[i] = vert[vorder[i]].C();
 		buffer += vert.size() * sizeof(vcg::Color4b);
 	}
 
+	//vertices are permuted only without faces.
 	quint16 *faces = (quint16 *)buffer;
 	for(int i = 0; i < fn; i++) {
-		TFace &f = face[i];
+		TFace &f = face[forder[i]];
 		for(int k = 0; k < 3; k++) {
 			TVertex *v = f.V(k);
 			faces[i*3 + k] = v - &*vert.begin();
@@ -535,13 +570,13 @@ float TMesh::quadricSimplify(quint32 target) {
 
 	vcg::math::Quadric<double> QZero;
 	QZero.SetZero();
-	vcg::tri::QuadricTexHelper<TMesh>::QuadricTemp TD3(this->vert,QZero);
-	vcg::tri::QuadricTexHelper<TMesh>::TDp3()=&TD3;
+	ThreadQuadricTexHelper<TMesh>::QuadricTemp TD3(this->vert,QZero);
+	ThreadQuadricTexHelper<TMesh>::TDp3()=&TD3;
 
-	std::vector<std::pair<vcg::TexCoord2<float>, vcg::Quadric5<double> > > qv;
+	ThreadQuadricTexHelper<TMesh>::QuadricVector qv;
 
-	vcg::tri::QuadricTexHelper<TMesh>::Quadric5Temp TD(this->vert,qv);
-	vcg::tri::QuadricTexHelper<TMesh>::TDp()=&TD;
+	ThreadQuadricTexHelper<TMesh>::Quadric5Temp TD(this->vert,qv);
+	ThreadQuadricTexHelper<TMesh>::TDp()=&TD;
 
 
 
@@ -551,6 +586,8 @@ float TMesh::quadricSimplify(quint32 target) {
 	DeciSession.SetTargetSimplices(target);
 	DeciSession.DoOptimization();
 	DeciSession.Finalize<MyTriEdgeCollapseQTex>();
+	ThreadQuadricTexHelper<TMesh>::TDp3() = nullptr;
+	ThreadQuadricTexHelper<TMesh>::TDp() = nullptr;
 
 	return edgeLengthError();
 }
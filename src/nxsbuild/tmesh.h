@@ -118,7 +118,9 @@ public:
 	void getTriangles(Triangle *triangles, quint32 node);
 	void getVertices(Splat *vertices, quint32 node);
 
+	//duplicates vertices where wedge tex coords differ, unsplitSeams merges them back.
 	void splitSeams(nx::Signature &sig);
+	void unsplitSeams();
 
 	float simplify(quint32 target_faces, Simplification method);
 	std::vector<TVertex> simplifyCloud(quint16 target_vertices); //return removed vertices
@@ -136,6 +138,8 @@ public:
 	vcg::Sphere3f boundingSphere();
 	nx::Cone3s normalsCone();
 protected:
+	std::vector<quint32> seam_origin; //original vertex of each vertex added by splitSeams
+
 	float randomSimplify(quint16 target_faces);
 	float quadricSimplify(quint32 target_faces);
 
@@ -152,9 +156,63 @@ public:
 	inline MyTriEdgeCollapse(  const TVertexPair &p, int i, vcg::BaseParameterClass *pp) :TECQ(p,i,pp){}
 };
 
-class MyTriEdgeCollapseQTex: public vcg::tri::TriEdgeCollapseQuadricTex< TMesh, TVertexPair, MyTriEdgeCollapseQTex, vcg::tri::QuadricTexHelper<TMesh> > {
+/* same as vcg::tri::QuadricTexHelper, but the temporary data pointers are per thread:
+   the vcg helper keeps them in function statics, and textured blocks could not be simplified concurrently. */
+
+template<class MeshType> class ThreadQuadricTexHelper {
+public:
+	typedef typename MeshType::VertexType VertexType;
+	typedef std::vector<std::pair<vcg::TexCoord2<float>, vcg::Quadric5<double> > > QuadricVector;
+	typedef vcg::SimpleTempData<typename MeshType::VertContainer, QuadricVector> Quadric5Temp;
+	typedef vcg::SimpleTempData<typename MeshType::VertContainer, vcg::math::Quadric<double> > QuadricTemp;
+
+	static void Alloc(VertexType *v, vcg::TexCoord2<float> &coord) {
+		vcg::Quadric5<double> q;
+		q.Zero();
+		q.Sum3(Qd3(v), coord.u(), coord.v());
+		Vect(v).push_back(std::make_pair(coord, q));
+	}
+	static void SumAll(VertexType *v, vcg::TexCoord2<float> &coord, vcg::Quadric5<double> &q) {
+		QuadricVector &qv = Vect(v);
+		for(size_t i = 0; i < qv.size(); i++) {
+			vcg::TexCoord2<float> &f = qv[i].first;
+			if(f.u() == coord.u() && f.v() == coord.v())
+				qv[i].second += q;
+			else
+				qv[i].second.Sum3(Qd3(v), f.u(), f.v());
+		}
+	}
+	static bool Contains(VertexType *v, vcg::TexCoord2<float> &coord) {
+		QuadricVector &qv = Vect(v);
+		for(size_t i = 0; i < qv.size(); i++)
+			if(qv[i].first.u() == coord.u() && qv[i].first.v() == coord.v())
+				return true;
+		return false;
+	}
+	static vcg::Quadric5<double> &Qd(VertexType *v, const vcg::TexCoord2<float> &coord) {
+		QuadricVector &qv = Vect(v);
+		for(size_t i = 0; i < qv.size(); i++)
+			if(qv[i].first.u() == coord.u() && qv[i].first.v() == coord.v())
+				return qv[i].second;
+		assert(0);
+		return qv[0].second;
+	}
+	static vcg::math::Quadric<double> &Qd3(VertexType *v) { return TD3()[*v]; }
+	static vcg::math::Quadric<double> &Qd3(const VertexType &v) { return TD3()[v]; }
+	static QuadricVector &Vect(VertexType *v) { return TD()[*v]; }
+	static typename MeshType::ScalarType W(VertexType * /*v*/) { return 1.0; }
+	static typename MeshType::ScalarType W(VertexType & /*v*/) { return 1.0; }
+	static void Merge(VertexType & /*v_dest*/, VertexType const & /*v_del*/) {}
+
+	static Quadric5Temp *&TDp() { thread_local Quadric5Temp *td = nullptr; return td; }
+	static Quadric5Temp &TD() { return *TDp(); }
+	static QuadricTemp *&TDp3() { thread_local QuadricTemp *td3 = nullptr; return td3; }
+	static QuadricTemp &TD3() { return *TDp3(); }
+};
+
+class MyTriEdgeCollapseQTex: public vcg::tri::TriEdgeCollapseQuadricTex< TMesh, TVertexPair, MyTriEdgeCollapseQTex, ThreadQuadricTexHelper<TMesh> > {
 public:
-	typedef  vcg::tri::TriEdgeCollapseQuadricTex< TMesh,  TVertexPair, MyTriEdgeCollapseQTex, vcg::tri::QuadricTexHelper<TMesh> > TECQ;
+	typedef  vcg::tri::TriEdgeCollapseQuadricTex< TMesh,  TVertexPair, MyTriEdgeCollapseQTex, ThreadQuadricTexHelper<TMesh> > TECQ;
 	inline MyTriEdgeCollapseQTex(  const TVertexPair &p, int i, vcg::BaseParameterClass *pp) :TECQ(p,i,pp){}
 };
 
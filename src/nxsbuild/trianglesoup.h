@@ -20,6 +20,7 @@ for more details.
 
 #include <vcg/space/point3.h>
 #include "../common/virtualarray.h"
+#include "checkpoint.h"
 
 //16  bytes
 struct Vertex {
@@ -80,24 +81,35 @@ typedef Bin<Splat> Cloud;
 template <class T> class VirtualBin: protected VirtualMemory {
 public:
 
-	//Triangle soup is guaranteed valid only until another call of getSoup (or resize, or clear)
-	//unless prevent_unload is true
+	//Triangle soup is guaranteed valid only until another call of get (or resize, or clear)
+	//unless the block is pinned
 
 	VirtualBin(QString prefix):
 		VirtualMemory(prefix),
 		triangles_per_block(1<<15),
 		block_size((1<<15) * sizeof(Triangle)) {
 	}
-	~VirtualBin() { flush(); }
+	~VirtualBin() { discard(); }
 
 	quint64 memoryUsed() { return VirtualMemory::memoryUsed(); }
 	void setMaxMemory(quint64 m) { VirtualMemory::setMaxMemory(m); }
 	quint64 maxMemory() { return VirtualMemory::maxMemory(); }
+	void setCompressed(bool on) { VirtualMemory::setCompressed(on); } //before adding blocks
 
-	Bin<T> get(quint64 n, bool prevent_unload = false) {
-		uchar *memory = getBlock(n, prevent_unload);
+	Bin<T> get(quint64 n) {
+		uchar *memory = getBlock(n);
 		return Bin<T>((T *)memory, &occupancy[n], triangles_per_block);
 	}
+	//thread safe: the bin stays valid while the handle is alive.
+	BlockHandle acquire(quint64 n, Bin<T> &bin) {
+		BlockHandle handle(this, n);
+		bin = Bin<T>((T *)handle.data, &occupancy[n], triangles_per_block);
+		return handle;
+	}
+	void pin(quint64 n) { pinBlock(n); }
+	void unpin(quint64 n) { unpinBlock(n); }
+	void prefetch(quint64 n) { prefetchBlock(n); }
+	const VirtualMemoryStats &stats() { return VirtualMemory::stats(); }
 
 	void drop(quint64 n) {
 		unmapBlock(n);
@@ -136,6 +148,34 @@ public:
 		return occupancy[block];
 	}
 
+	//dump the used part of each block, used for checkpoints.
+	void save(QFile &file) {
+		writeValue(file, triangles_per_block);
+		writeVector(file, occupancy);
+		for(quint64 i = 0; i < occupancy.size(); i++) {
+			qint64 size = occupancy[i]*sizeof(T);
+			if(size && file.write((char *)getBlock(i), size) != size)
+				throw QString("failed writing checkpoint %1: %2").arg(file.fileName()).arg(file.errorString());
+			dropBlock(i);
+		}
+	}
+	void restore(QFile &file) {
+		clear();
+		quint64 n;
+		readValue(file, n);
+		setTrianglesPerBlock(n);
+		std::vector<quint32> used;
+		readVector(file, used);
+		for(quint64 i = 0; i < used.size(); i++) {
+			addBlock();
+			qint64 size = used[i]*sizeof(T);
+			if(size && file.read((char *)getBlock(i), size) != size)
+				throw QString("truncated checkpoint: %1").arg(file.fileName());
+			occupancy[i] = used[i];
+			dropBlock(i);
+		}
+	}
+
 	/*
 	Soup getSoup(quint64 n, bool prevent_unload = false);
 	void dropSoup(quint64 n);
@@ -24,6 +24,7 @@ SOURCES += \
     ../../../vcglib/wrap/system/qgetopt.cpp \
     ../../../vcglib/wrap/ply/plylib.cpp \
     ../common/virtualarray.cpp \
+    ../common/blockcodec.cpp \
     ../common/nexusdata.cpp \
     ../common/traversal.cpp \
     ../common/cone.cpp \
@@ -38,6 +39,7 @@ SOURCES += \
 HEADERS += \
     ../../../vcglib/wrap/system/qgetopt.h \
     ../common/virtualarray.h \
+    ../common/blockcodec.h \
     ../common/nexusdata.h \
     ../common/traversal.h \
     ../common/signature.h \